@@ -19,6 +19,21 @@
 
 #include <bits/pthreadtypes.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <linux/io_uring.h>
 
 #include "basic_types.h"
 #include "UintXTrieSet.hpp"
@@ -34,6 +49,124 @@ namespace MTLL { // MultiThreaded Locking Looper
 
 
 
+static inline bool atomicLoad(bool *p)               { return __atomic_load_n(p, __ATOMIC_SEQ_CST);       }
+static inline uinta atomicLoad(uinta *p)             { return __atomic_load_n(p, __ATOMIC_SEQ_CST);       }
+static inline void atomicStore(bool *p, bool v)      { __atomic_store_n(p, v, __ATOMIC_SEQ_CST);          }
+static inline uinta atomicIncrement(uinta *p)        { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+static inline uinta atomicDecrement(uinta *p)        { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST); }
+static inline uinta atomicFetchIncrement(uinta *p)   { return __atomic_fetch_add(p, 1, __ATOMIC_SEQ_CST); }
+static inline uinta atomicFetchOr(uinta *p, uinta v) { return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST);  }
+static inline uinta atomicFetchAnd(uinta *p, uinta v) { return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST); }
+static inline uinta atomicAdd(uinta *p, uinta v)     { return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST); }
+static inline void atomicStore(uinta *p, uinta v)    { __atomic_store_n(p, v, __ATOMIC_SEQ_CST);          }
+static inline bool atomicCompareExchange(uinta *p, uinta *expected, uinta v)
+    {
+    return __atomic_compare_exchange_n(p, expected, v, NO, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+static inline inta relaxedLoad(inta *p)              { return __atomic_load_n(p, __ATOMIC_RELAXED);       }
+static inline void relaxedStore(inta *p, inta v)     { __atomic_store_n(p, v, __ATOMIC_RELAXED);          }
+static inline uinta relaxedLoad(uinta *p)            { return __atomic_load_n(p, __ATOMIC_RELAXED);       }
+static inline void relaxedStore(uinta *p, uinta v)   { __atomic_store_n(p, v, __ATOMIC_RELAXED);          }
+static inline Looper *atomicLoad(Looper **p)         { return __atomic_load_n(p, __ATOMIC_SEQ_CST);       }
+static inline Looper *atomicExchange(Looper **p)     { return __atomic_exchange_n(p, (Looper*)0, __ATOMIC_SEQ_CST); }
+static inline bool atomicClaim(Looper **p, Looper *v)
+    {
+    Looper *expected = 0;
+    return __atomic_compare_exchange_n(p, &expected, v, NO, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    }
+
+static inline void cpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+    }
+
+static void futexWait(uint32 *addr, uint32 value)
+    {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, 0, 0, 0);
+    }
+
+static void futexWaitMicros(uint32 *addr, uint32 value, uint64 micros)
+    {
+    struct timespec timeout;
+    timeout.tv_sec = micros/1000000;
+    timeout.tv_nsec = micros%1000000*1000;
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, &timeout, 0, 0);
+    }
+
+static void futexWake(uint32 *addr)
+    {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+    }
+
+// Reads a list like 0-3,8,10-11 from a sysfs file into a cpu_set_t, which is
+// used for sets of NUMA node numbers as well as for sets of CPU numbers.
+static bool readSysList(const char *path, cpu_set_t *set)
+    {
+    CPU_ZERO(set);
+    FILE *f = fopen(path, "r");
+    if (!f) return NO;
+    char buf[4096];
+    const bool ok = fgets(buf, sizeof(buf), f) != 0;
+    fclose(f);
+    if (!ok) return NO;
+    char *p = buf;
+    while (*p >= '0' && *p <= '9')
+        {
+        const uinta first = strtoul(p, &p, 10);
+        uinta last = first;
+        if (*p == '-') last = strtoul(p + 1, &p, 10);
+        for (uinta i = first; i <= last && i < CPU_SETSIZE; i++) CPU_SET(i, set);
+        if (*p == ',') p++;
+        }
+    return YES;
+    }
+
+// Memory that's mapped but not yet touched gets its pages from the preferred
+// node. If the kernel won't do it the memory's still usable, just not local.
+static void *mapMemory(uinta size)
+    {
+    void *mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(mem != MAP_FAILED);
+    return mem;
+    }
+
+static void *mapOnNode(uinta size, uinta node)
+    {
+    void *mem = mapMemory(size);
+    unsigned long mask[CPU_SETSIZE/(8*sizeof(unsigned long))] = { 0 };
+    mask[node/(8*sizeof(unsigned long))] |= 1UL << node%(8*sizeof(unsigned long));
+    syscall(SYS_mbind, mem, size, MPOL_PREFERRED, mask, 8*sizeof(mask), 0);
+    return mem;
+    }
+
+static uinta pageAlign(uinta size)
+    {
+    const uinta pageSize = sysconf(_SC_PAGESIZE);
+    return (size + pageSize - 1)/pageSize*pageSize;
+    }
+
+static uint64 monotonicMicros()
+    {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000*(uint64)ts.tv_sec + ts.tv_nsec/1000;
+    }
+
+static uint64 monotonicNanos()
+    {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000*(uint64)ts.tv_sec + ts.tv_nsec;
+    }
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
 class LockQHdr
     {
 private:
@@ -45,337 +178,3657 @@ private:
     void init() { firstShared = 0; waiting.init(); }
     };
 
+// A contended lock's wait queues, 1 per priority, which follow it in the same
+// block from a node's lock pool. The pool's free list link overlays poolLink.
+// Loopers that want the lock in X, IX or SIX mode are queued with the exclusive
+// waiters. It also counts the lock's IS, IX and SIX holders.
+class LockWaiters
+    {
+private:
+    friend class Controller;
+    friend class Lock;
+
+    void *poolLink;
+    NodePool *pool;
+    LockQHdr *priorities;
+    Looper *upgrader;
+    uinta intentHolders[3];
+    PriorityBitmap waitingPriorities;
+    PriorityBitmap exclusivePriorities;
+    bool exclusivePhase;
+    };
+
 class LockSetIterator : private UintaTrieSet::Iterator
     {
 private:
     friend class Controller;
 
-    LockSetIterator()               :        UintaTrieSet::Iterator::Iterator()                     { }
-    LockSetIterator(LockSet *lkset) :        UintaTrieSet::Iterator::Iterator((UintaTrieSet*)lkset) { }
-    void init(LockSet *lkset)       {        UintaTrieSet::Iterator::init((UintaTrieSet*)lkset);      }
-    bool next(Lock **lk)            { return UintaTrieSet::Iterator::next((uinta*)lk);                }
-    };
+    LockSetIterator()               :        UintaTrieSet::Iterator::Iterator()                     { }
+    LockSetIterator(LockSet *lkset) :        UintaTrieSet::Iterator::Iterator((UintaTrieSet*)lkset) { }
+    void init(LockSet *lkset)       {        UintaTrieSet::Iterator::init((UintaTrieSet*)lkset);      }
+    bool next(Lock **lk)            { uinta mode; return next(lk, &mode);                              }
+    bool next(Lock **lk, uinta *mode);
+    };
+
+// The ready loopers, by priority. In work stealing mode each worker owns one,
+// otherwise all the workers share a single one. Its count and top priority
+// may be read without holding its mutex, but only change while holding it.
+// With Options::fairShare the loopers ready at each priority are kept in a skew
+// heap, ordered by their virtual run times, the time they've run for divided by
+// their weights. Their list links are the heap's child links. The floor's the
+// highest virtual run time taken from the heap so far, which loopers that haven't
+// been ready are brought up to, so being idle doesn't earn them extra time later.
+// Virtual run times are compared allowing for them wrapping round.
+class FairHeap
+    {
+private:
+    friend class ReadyQueue;
+
+    Looper *root;
+    uint64 floor;
+
+    static bool before(uint64 a, uint64 b) { return (int64)(a - b) < 0; }
+    static Looper *merge(Looper *a, Looper *b);
+
+    void init()                            { root = 0; floor = 0;        }
+    bool empty()                           { return !root;               }
+    void push(Looper *lpr);
+    Looper *pop();
+    };
+
+class ReadyQueue
+    {
+private:
+    friend class Controller;
+
+    DList<Looper> *priorities;
+    FairHeap *heaps;
+    PriorityBitmap inUse;
+    uinta count;
+    inta top;
+    pthread_mutex_t mutex;
+
+    void init(uinta maxPriority, DList<Looper> *priorities, FairHeap *heaps);
+    void push(Looper *lpr, uinta priority);
+    Looper *pop();
+    void takeMutex()    { assert(!pthread_mutex_lock(&mutex));   }
+    void releaseMutex() { assert(!pthread_mutex_unlock(&mutex)); }
+    } __attribute__((aligned(64)));
+
+class Worker
+    {
+private:
+    friend class Controller;
+    friend void *mtllStartThread(void *context);
+
+    Controller *controller;
+    ReadyQueue *queue;
+    NumaNode *node;
+    Worker *nextParked;
+    uinta index;
+    uinta nodeIndex;
+    uinta spinMicros;
+    Looper *runNext;
+    void *taskCache;
+    uinta taskCacheCount;
+    IoRing *ring;
+    uinta resumed;
+    uinta affinityHits;
+    uinta tasksRun;
+    uinta graceSnapshot;
+    uint32 parked;
+    bool running;
+    bool polling;
+    bool live;
+    bool blocking;
+    bool graceWaiting;
+    } __attribute__((aligned(64)));
+
+// A looper's pending count is the number of its tasks which have been queued
+// but haven't finished, plus this bit once it's been passed to safeDelete().
+// Whoever moves the count off 0 owns the looper, and is responsible for making
+// it ready or putting it in a lock's wait queue. The owner keeps it while the
+// count stays above 0, and when it drops to 0 the looper's idle again.
+static const uinta LOOPER_DELETE_BIT = ((uinta)1) << (8*sizeof(uinta) - 1);
+
+// The unit of a looper group's running count, in the high half of its references.
+static const uinta GROUP_RUNNING = ((uinta)1) << (4*sizeof(uinta));
+
+// A lock's state word holds its holder count, whether it's held in exclusive
+// mode, and whether it's contended. attemptLock() and unlock() change it with
+// a single compare and swap, without the mutex, unless it's contended. It's
+// marked contended, with the mutex held, when a looper waits for it (or to
+// upgrade it) or it's marked for delete, and it stays contended until it has
+// no waiters left, so while it's contended only the mutex holder changes it.
+static const uinta LOCK_EXCLUSIVE = ((uinta)1) << (8*sizeof(uinta) - 1);
+static const uinta LOCK_CONTENDED = ((uinta)1) << (8*sizeof(uinta) - 2);
+static const uinta LOCK_DELETE = ((uinta)1) << (8*sizeof(uinta) - 3);
+static const uinta LOCK_HOLDERS = LOCK_DELETE - 1;
+
+// The modes each mode's compatible with, and those queued as exclusive waiters.
+static inline uinta modeBit(uinta mode) { return ((uinta)1) << mode; }
+static const uinta COMPATIBLE_MODES[] =
+    {
+    modeBit(MODE_S) | modeBit(MODE_IS),
+    0,
+    modeBit(MODE_S) | modeBit(MODE_IS) | modeBit(MODE_IX) | modeBit(MODE_SIX),
+    modeBit(MODE_IS) | modeBit(MODE_IX),
+    modeBit(MODE_IS)
+    };
+static const uinta EXCLUSIVE_WAITER_MODES = modeBit(MODE_X) | modeBit(MODE_IX) | modeBit(MODE_SIX);
+
+// Virtual run times are scaled up before they're divided by the weights, so
+// short runs still count.
+static const uinta FAIR_WEIGHT_SHIFT = 10;
+
+// The number of pooled task blocks a worker's cache takes from its node's pool,
+// or gives back to it, at once.
+static const uinta TASK_CACHE_BATCH = 32;
+
+// A group of CPUs sharing local memory. Without Options::numaAware there's a
+// single node, with all the queues.
+class NumaNode
+    {
+private:
+    friend class Controller;
+    friend class Lock;
+
+    uinta index;
+    cpu_set_t cpus;
+    uinta workerCount;
+    ReadyQueue **queues;
+    uinta queueCount;
+    NodePool *lockPool;
+    NodePool *taskPool;
+    };
+
+// Fixed size blocks of memory on a NUMA node (or anywhere if the node's -1).
+// Chunks of blocks are mapped as they're needed, so new blocks are zeroed, and
+// freed blocks are kept for reuse.
+class NodePool
+    {
+private:
+    friend class Controller;
+    friend class Lock;
+    friend class Task;
+
+    uinta blockSize;
+    inta node;
+    void *freeBlocks;
+    char *chunk;
+    uinta chunkLeft;
+    pthread_mutex_t mutex;
+
+    void init(uinta blockSize, inta node);
+    void *take();
+    void *alloc();
+    void *allocList(uinta count);
+    void free(void *block);
+    void freeList(void *first, void *last);
+    };
+
+// A Task's timer state. A periodic timer's task is fired while it's enqueued or
+// running, and it's rearmed afterwards unless it's been cancelled meanwhile. An
+// idle timer's period is 0, so the Task's not rearmed if it's reused.
+static const uint8 TIMER_IDLE = 0;
+static const uint8 TIMER_ARMED = 1;
+static const uint8 TIMER_FIRED = 2;
+static const uint8 TIMER_CANCELLED = 3;
+static const uint64 TIMER_NEVER = ~(uint64)0;
+
+// The state only Tasks that use timers, io or several locks need is kept apart
+// from the Task, allocated the first time it's needed and kept until the Task's
+// deleted, so that the Tasks that don't, most of them, stay small. It's put in
+// blocks from the Controller's Task pool, and remembers which pool, so that a
+// Task deleted directly rather than by the Controller can give it back.
+class TaskSide
+    {
+private:
+    friend class Controller;
+    friend class Task;
+
+    NodePool *pool;
+    };
+
+class TaskTimer : public TaskSide
+    {
+private:
+    friend class Controller;
+    friend class TimerWheel;
+
+    uint64 deadline;
+    uint64 period;
+    uint8 state;
+    uint8 level;
+    uint8 slot;
+    };
+
+class TaskIo : public TaskSide
+    {
+private:
+    friend class Controller;
+    friend class Task;
+
+    IoWatch *watch;
+    uint32 events;
+    inta result;
+    };
+
+static const uinta TASK_LOCKS_INLINE = 4;
+
+// A count of 0 means the Task's last enqueue asked for 1 lock or none. A few
+// requests fit in the TaskLocks itself, more are put in an array that's kept,
+// and only grown, for the next time.
+class TaskLocks : public TaskSide
+    {
+private:
+    friend class Controller;
+    friend class Task;
+
+    LockRequest *requests;
+    uinta count;
+    uinta capacity;
+    LockRequest few[TASK_LOCKS_INLINE];
+
+    TaskLocks() { requests = few; count = 0; capacity = TASK_LOCKS_INLINE; }
+    ~TaskLocks() { if (requests != few) delete[] requests; }
+    };
+
+// A hierarchical timer wheel. Level l has 64 slots each covering 64^l ticks. A
+// timer's kept at the lowest level where its deadline and the current tick
+// differ only in that level's bits or below, so inserting and removing are
+// O(1). When the current tick reaches the start of a slot's range the slot's
+// timers cascade down to lower levels, or expire if it's a level 0 slot. The
+// bitmaps of occupied slots let the wheel skip straight to the next tick at
+// which anything happens. Deadlines are in ticks, and always after now.
+class TimerWheel
+    {
+private:
+    friend class Controller;
+
+    static const uinta LEVELS = 11;
+
+    DList<Task> slots[LEVELS][64];
+    uint64 occupied[LEVELS];
+    uint64 now;
+    uinta count;
+
+    void init(uint64 tick);
+    void insert(Task *t);
+    void remove(Task *t);
+    uint64 nextTick();
+    void advance(uint64 tick, DList<Task> *expired);
+    };
+
+// A file descriptor watched for a task. The state holds the events that have
+// arrived since the task last ran, and whether the task's queued (or running)
+// or the watch has been removed. Edge triggered events are never lost, while
+// the task's queued they accumulate and it's queued again after it's run.
+static const uint32 IO_EVENTS = 0xFFFF;
+static const uint32 IO_DEAD = (uint32)1 << 30;
+static const uint32 IO_QUEUED = (uint32)1 << 31;
+
+class IoWatch
+    {
+private:
+    friend class Controller;
+
+    Task *task;
+    Looper *lpr;
+    IoRing *ring;
+    int fd;
+    uint32 state;
+    };
+
+// An io_uring instance, set up and mapped with raw system calls. Each worker
+// gets its own when it first submits an operation, and only that worker fills
+// in and submits its entries, so they're batched without any locking until it
+// next looks for a looper to run. Threads outside the pool share a ring that's
+// submitted at once while holding ringMutex. Completions are reaped by the
+// ring's worker between loopers, or by the polling worker when the ring's
+// eventfd (watched by the Controller's epoll) says there are some, whichever
+// gets cqMutex. The user data of each operation is its completion Task.
+class IoRing
+    {
+private:
+    friend class Controller;
+
+    int fd;
+    int eventFd;
+    uint32 *sqHead;
+    uint32 *sqTail;
+    uint32 sqMask;
+    uint32 *sqArray;
+    uint32 sqEntries;
+    struct io_uring_sqe *sqes;
+    uint32 *cqHead;
+    uint32 *cqTail;
+    uint32 cqMask;
+    struct io_uring_cqe *cqes;
+    uint32 unsubmitted;
+    IoWatch watch;
+    pthread_mutex_t cqMutex;
+
+    bool init(uinta entries, const struct iovec *buffers, uinta bufferCount);
+    struct io_uring_sqe *nextSqe();
+    bool completions() { return __atomic_load_n(cqHead, __ATOMIC_RELAXED) != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE); }
+    };
+
+// An operation handed to the offload threads when io_uring isn't available.
+class IoJob
+    {
+private:
+    friend class Controller;
+
+    IoJob *next;
+    Task *t;
+    void *buf;
+    uinta len;
+    uint64 offset;
+    int fd;
+    uint8 op;
+    };
+
+// A future's continuations are replaced by this once its value's ready.
+static Task *const FUTURE_COMPLETED = (Task*)1;
+
+// whenAll()'s and whenAny()'s shared state, with an arm for each input future.
+// The arms are continuations without a looper, which are handled directly when
+// their input's ready, and each holds a reference to the join until then.
+class FutureJoin : public FutureValue<uinta>
+    {
+private:
+    friend class Controller;
+
+    JoinArm *arms;
+    uinta count;
+    uinta fired;
+    bool any;
+
+    ~FutureJoin();
+    };
+
+class JoinArm : public Task
+    {
+private:
+    friend class Controller;
+
+    FutureJoin *join;
+    uinta index;
+
+    void mtllRun(Controller *c, Looper *lpr) { assert(false); }
+    };
+
+FutureJoin::~FutureJoin()
+    {
+    delete[] arms;
+    }
+
+static __thread Worker *currentWorker = 0;
+static __thread uinta nextForeignQueue = 0;
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
+Looper::Looper()
+    {
+    init(0);
+    }
+
+Looper::Looper(LooperGroup *group)
+    {
+    init(group);
+    }
+
+void Looper::init(LooperGroup *group)
+    {
+    mtllNext = mtllPrev = 0;
+    runningTaskPriority = 0;
+    homeNode = -1;
+    lastWorker = 0;
+    quantumTasks = quantumMicros = 0;
+    weight = 1;
+    vruntime = runNanos = 0;
+    taskRunning = NO;
+    waitingMode = MODE_S;
+    pending = 0;
+    tasks.init();
+    this->group = group;
+    groupNext = groupPrev = 0;
+    waitingFor = 0;
+    waitNext = waitPrev = 0;
+    waitingSince = 0;
+    waitingPriority = 0;
+    deadlockParent = 0;
+    deadlockMark = 0;
+    if (group) group->controller->addMember(group, this);
+    }
+
+Looper::~Looper()
+    {
+    assert(!taskRunning);
+    assert(!tasks.first());
+    assert(!(pending & ~LOOPER_DELETE_BIT));
+    assert(!locksHeld.size());
+    }
+
+LooperGroup::LooperGroup(Controller *c)
+    {
+    controller = c;
+    nextStopped = 0;
+    members = 0;
+    haltedCount = 0;
+    refs = 1;
+    stopping = stopScheduled = NO;
+    }
+
+LooperGroup::~LooperGroup()
+    {
+    assert(!members);
+    assert(!stopScheduled);
+    assert(stopTasks.empty());
+    }
+
+uinta Looper::priority()
+    {
+    if (__atomic_load_n(&taskRunning, __ATOMIC_ACQUIRE)) return __atomic_load_n(&runningTaskPriority, __ATOMIC_RELAXED);
+    Task *t = tasks.first();
+    return t ? t->mtllPrio : 0;
+    }
+
+
+
+Task::Task()
+    {
+    mtllNext = 0;
+    mtllPrev = 0;
+    mtllPrio = 0;
+    mtllLock = 0;
+    mtllTarget = 0;
+    mtllTimer = 0;
+    mtllIo = 0;
+    mtllLocks = 0;
+    mtllMode = MODE_S;
+    mtllDeleteAfterwards = NO;
+    mtllRefused = NO;
+    mtllUpgrade = NO;
+    mtllPooled = NO;
+    }
+
+// The Controller gives back the side state of the Tasks it deletes itself, so
+// this is only for a Task that's deleted directly.
+Task::~Task()
+    {
+    if (mtllTimer) mtllTimer->pool->free(mtllTimer);
+    if (mtllIo) mtllIo->pool->free(mtllIo);
+    if (mtllLocks)
+        {
+        mtllLocks->~TaskLocks();
+        mtllLocks->pool->free(mtllLocks);
+        }
+    }
+
+uint32 Task::mtllEvents()
+    {
+    return mtllIo ? mtllIo->events : 0;
+    }
+
+inta Task::mtllResult()
+    {
+    return mtllIo ? mtllIo->result : 0;
+    }
+
+
+
+// Nothing's allocated until a looper has to wait for the lock.
+Lock::Lock(Controller *c)
+    {
+    waiters = 0;
+    parent = 0;
+    state = 0;
+    policy = POLICY_WRITER_PREFERRING;
+    }
+
+Lock::Lock(Controller *c, Lock *parent)
+    {
+    waiters = 0;
+    this->parent = parent;
+    state = 0;
+    policy = POLICY_WRITER_PREFERRING;
+    }
+
+Lock::Lock(Controller *c, Lock *parent, LockPolicy policy)
+    {
+    waiters = 0;
+    this->parent = parent;
+    state = 0;
+    this->policy = policy;
+    }
+
+Lock::~Lock()
+    {
+    assert(!(state & LOCK_HOLDERS));
+    if (waiters) waiters->pool->free(waiters);
+    }
+
+
+
+Options::Options()
+    {
+    workStealing = NO;
+    fairShare = NO;
+    quantumTasks = 1;
+    quantumMicros = 0;
+    spinMicros = 0;
+    maxThreads = 0;
+    autoScale = NO;
+    idleRetireMicros = 1000000;
+    timerTickMicros = 1000;
+    ioPollMicros = 1000;
+    ioUring = YES;
+    ioRingEntries = 256;
+    ioOffloadThreads = 4;
+    cpuSets = 0;
+    cpuSetCount = 0;
+    numaAware = NO;
+    deadlockHandler = 0;
+    deadlockScanMicros = 0;
+    lockAgingMicros = 0;
+    }
+
+
+
+LockRequest::LockRequest()
+    {
+    lk = 0;
+    mode = MODE_S;
+    }
+
+LockRequest::LockRequest(Lock *lk, bool exclusive)
+    {
+    this->lk = lk;
+    mode = exclusive ? MODE_X : MODE_S;
+    }
+
+LockRequest::LockRequest(Lock *lk, LockMode mode)
+    {
+    this->lk = lk;
+    this->mode = mode;
+    }
+
+BatchEntry::BatchEntry()
+    {
+    lpr = 0;
+    t = 0;
+    priority = 0;
+    deleteAfterwards = NO;
+    lk = 0;
+    exclusive = NO;
+    }
+
+BatchEntry::BatchEntry(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards)
+    {
+    this->lpr = lpr;
+    this->t = t;
+    this->priority = priority;
+    this->deleteAfterwards = deleteAfterwards;
+    lk = 0;
+    exclusive = NO;
+    }
+
+BatchEntry::BatchEntry(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive)
+    {
+    this->lpr = lpr;
+    this->t = t;
+    this->priority = priority;
+    this->deleteAfterwards = deleteAfterwards;
+    this->lk = lk;
+    this->exclusive = exclusive;
+    }
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
+// Held in shared or exclusive mode is reported as MODE_S, the lock's state says which.
+bool LockSetIterator::next(Lock **lk, uinta *mode)
+    {
+    uinta key;
+    if (!UintaTrieSet::Iterator::next(&key)) return NO;
+    const uinta tag = key & 3;
+    *lk = (Lock*)(key - tag);
+    *mode = tag ? MODE_X + tag : MODE_S;
+    return YES;
+    }
+
+// Merges two heaps top down, iteratively rather than recursively as the right
+// spine can be long. Each looper on the merge path has its children swapped,
+// with the rest of the merge becoming its left child.
+Looper *FairHeap::merge(Looper *a, Looper *b)
+    {
+    Looper *root = 0;
+    Looper **link = &root;
+    while (a && b)
+        {
+        if (before(b->vruntime, a->vruntime))
+            {
+            Looper *t = a;
+            a = b;
+            b = t;
+            }
+        *link = a;
+        Looper *right = a->mtllPrev;
+        a->mtllPrev = a->mtllNext;
+        link = &a->mtllNext;
+        a = right;
+        }
+    *link = a ? a : b;
+    return root;
+    }
+
+void FairHeap::push(Looper *lpr)
+    {
+    if (before(lpr->vruntime, floor)) lpr->vruntime = floor;
+    lpr->mtllNext = lpr->mtllPrev = 0;
+    root = merge(root, lpr);
+    }
+
+Looper *FairHeap::pop()
+    {
+    Looper *lpr = root;
+    root = merge(lpr->mtllNext, lpr->mtllPrev);
+    lpr->mtllNext = lpr->mtllPrev = 0;
+    if (before(floor, lpr->vruntime)) floor = lpr->vruntime;
+    return lpr;
+    }
+
+void ReadyQueue::init(uinta maxPriority, DList<Looper> *priorities, FairHeap *heaps)
+    {
+    this->priorities = priorities;
+    this->heaps = heaps;
+    for (uinta i = 0; i <= maxPriority; i++) priorities[i].init();
+    if (heaps) for (uinta i = 0; i <= maxPriority; i++) heaps[i].init();
+    inUse.init(maxPriority);
+    count = 0;
+    top = -1;
+    assert(!pthread_mutex_init(&mutex, 0));
+    }
+
+void ReadyQueue::push(Looper *lpr, uinta priority)
+    {
+    if (heaps)
+        heaps[priority].push(lpr);
+    else
+        priorities[priority].linkLast(lpr);
+    inUse.set(priority);
+    if ((inta)priority > top) relaxedStore(&top, priority);
+    atomicIncrement(&count);
+    }
+
+Looper *ReadyQueue::pop()
+    {
+    if (top < 0) return 0;
+    Looper *lpr = heaps ? heaps[top].pop() : priorities[top].unlinkFirst();
+    if (heaps ? heaps[top].empty() : priorities[top].empty())
+        {
+        inUse.clear(top);
+        relaxedStore(&top, inUse.highest());
+        }
+    atomicDecrement(&count);
+    return lpr;
+    }
+
+
+
+void TimerWheel::init(uint64 tick)
+    {
+    for (uinta l = 0; l < LEVELS; l++)
+        {
+        for (uinta s = 0; s < 64; s++) slots[l][s].init();
+        occupied[l] = 0;
+        }
+    now = tick;
+    count = 0;
+    }
+
+void TimerWheel::insert(Task *t)
+    {
+    TaskTimer *timer = t->mtllTimer;
+    const uinta level = (63 - __builtin_clzll(timer->deadline ^ now))/6;
+    const uinta slot = (timer->deadline >> 6*level) & 63;
+    timer->level = level;
+    timer->slot = slot;
+    slots[level][slot].linkLast(t);
+    occupied[level] |= (uint64)1 << slot;
+    count++;
+    }
+
+void TimerWheel::remove(Task *t)
+    {
+    const TaskTimer *timer = t->mtllTimer;
+    DList<Task> *list = &slots[timer->level][timer->slot];
+    list->unlink(t);
+    if (list->empty()) occupied[timer->level] &= ~((uint64)1 << timer->slot);
+    count--;
+    }
+
+// Returns the next tick at which a slot expires or cascades, or TIMER_NEVER.
+uint64 TimerWheel::nextTick()
+    {
+    uint64 next = TIMER_NEVER;
+    for (uinta l = 0; l < LEVELS; l++)
+        {
+        const uinta current = (now >> 6*l) & 63;
+        const uint64 later = current == 63 ? 0 : occupied[l] & (~(uint64)0 << (current + 1));
+        if (!later) continue;
+        const uint64 base = 6*(l + 1) >= 64 ? 0 : now >> 6*(l + 1) << 6*(l + 1);
+        const uint64 tick = base | (uint64)__builtin_ctzll(later) << 6*l;
+        if (tick < next) next = tick;
+        }
+    return next;
+    }
+
+void TimerWheel::advance(uint64 tick, DList<Task> *expired)
+    {
+    for ( ; ; )
+        {
+        const uint64 next = nextTick();
+        if (next > tick)
+            {
+            if (tick > now) now = tick;
+            return;
+            }
+        now = next;
+        for (inta l = LEVELS - 1; l >= 0; l--)
+            {
+            if (l && now & (((uint64)1 << 6*l) - 1)) continue;
+            const uinta slot = (now >> 6*l) & 63;
+            if (!(occupied[l] >> slot & 1)) continue;
+            occupied[l] &= ~((uint64)1 << slot);
+            DList<Task> *list = &slots[l][slot];
+            Task *t;
+            while ((t = list->unlinkFirst()))
+                {
+                count--;
+                if (t->mtllTimer->deadline <= now)
+                    expired->linkLast(t);
+                else
+                    insert(t);
+                }
+            }
+        }
+    }
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
+void NodePool::init(uinta blockSize, inta node)
+    {
+    this->blockSize = blockSize < sizeof(void*) ? sizeof(void*) : alignLen(blockSize);
+    this->node = node;
+    freeBlocks = 0;
+    chunk = 0;
+    chunkLeft = 0;
+    assert(!pthread_mutex_init(&mutex, 0));
+    }
+
+// Called with the mutex held.
+void *NodePool::take()
+    {
+    void *block = freeBlocks;
+    if (block)
+        freeBlocks = *(void**)block;
+    else
+        {
+        if (chunkLeft < blockSize)
+            {
+            chunkLeft = pageAlign(64*blockSize);
+            chunk = (char*)(node < 0 ? mapMemory(chunkLeft) : mapOnNode(chunkLeft, node));
+            }
+        block = chunk;
+        chunk += blockSize;
+        chunkLeft -= blockSize;
+        }
+    return block;
+    }
+
+void *NodePool::alloc()
+    {
+    assert(!pthread_mutex_lock(&mutex));
+    void *block = take();
+    assert(!pthread_mutex_unlock(&mutex));
+    return block;
+    }
+
+// Returns count blocks linked through their first words.
+void *NodePool::allocList(uinta count)
+    {
+    void *list = 0;
+    assert(!pthread_mutex_lock(&mutex));
+    for (uinta i = 0; i < count; i++)
+        {
+        void *block = take();
+        *(void**)block = list;
+        list = block;
+        }
+    assert(!pthread_mutex_unlock(&mutex));
+    return list;
+    }
+
+void NodePool::free(void *block)
+    {
+    freeList(block, block);
+    }
+
+void NodePool::freeList(void *first, void *last)
+    {
+    assert(!pthread_mutex_lock(&mutex));
+    *(void**)last = freeBlocks;
+    freeBlocks = first;
+    assert(!pthread_mutex_unlock(&mutex));
+    }
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
+// Returns NO if the kernel doesn't support io_uring (or won't give the process
+// another instance), or won't register the buffers.
+bool IoRing::init(uinta entries, const struct iovec *buffers, uinta bufferCount)
+    {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return NO;
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    uinta sqSize = params.sq_off.array + params.sq_entries*sizeof(uint32);
+    const uinta cqSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if (single && cqSize > sqSize) sqSize = cqSize;
+    const uinta sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+    char *sq = (char*)mmap(0, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = single ? sq : (char*)mmap(0, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = (struct io_uring_sqe*)mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || eventFd < 0
+            || syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &eventFd, 1)
+            || (bufferCount && syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers, bufferCount)))
+        {
+        if (sq != MAP_FAILED) munmap(sq, sqSize);
+        if (!single && cq != MAP_FAILED) munmap(cq, cqSize);
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (eventFd >= 0) close(eventFd);
+        close(fd);
+        return NO;
+        }
+    sqHead = (uint32*)(sq + params.sq_off.head);
+    sqTail = (uint32*)(sq + params.sq_off.tail);
+    sqMask = *(uint32*)(sq + params.sq_off.ring_mask);
+    sqArray = (uint32*)(sq + params.sq_off.array);
+    sqEntries = params.sq_entries;
+    cqHead = (uint32*)(cq + params.cq_off.head);
+    cqTail = (uint32*)(cq + params.cq_off.tail);
+    cqMask = *(uint32*)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    unsubmitted = 0;
+    assert(!pthread_mutex_init(&cqMutex, 0));
+    return YES;
+    }
+
+// Returns 0 if the submission queue's full.
+struct io_uring_sqe *IoRing::nextSqe()
+    {
+    const uint32 tail = *sqTail;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) return 0;
+    return sqes + (tail & sqMask);
+    }
+
+// Does an operation with a blocking system call for the offload threads. If the
+// file descriptor's non-blocking it waits in poll() until the call can succeed,
+// as io_uring would.
+static inta performIo(uint8 op, int fd, void *buf, uinta len, uint64 offset)
+    {
+    for ( ; ; )
+        {
+        ssize_t done;
+        short events = POLLIN;
+        switch (op)
+            {
+            case IORING_OP_READ:
+            case IORING_OP_READ_FIXED:
+                done = offset == ~(uint64)0 ? read(fd, buf, len) : pread(fd, buf, len, offset);
+                break;
+            case IORING_OP_WRITE:
+            case IORING_OP_WRITE_FIXED:
+                done = offset == ~(uint64)0 ? write(fd, buf, len) : pwrite(fd, buf, len, offset);
+                events = POLLOUT;
+                break;
+            default:
+                done = accept4(fd, 0, 0, SOCK_CLOEXEC);
+                break;
+            }
+        if (done >= 0) return done;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -errno;
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = events;
+        poll(&pfd, 1, -1);
+        }
+    }
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
+extern "C" void *mtllStartThread(void *context)
+    {
+    Worker *w = (Worker*)context;
+    w->controller->runPoolThread(w);
+    return 0;
+    }
+
+extern "C" void *mtllStartOffloadThread(void *context)
+    {
+    ((Controller*)context)->runOffloadThread();
+    return 0;
+    }
+
+Controller::Controller(uinta threadCount, uinta maxPriority)
+    {
+    Options opts;
+    init(threadCount, maxPriority, &opts);
+    }
+
+Controller::Controller(uinta threadCount, uinta maxPriority, const Options *opts)
+    {
+    init(threadCount, maxPriority, opts);
+    }
+
+Controller::~Controller()
+    {
+    assert(false);
+    }
+
+void Controller::init(uinta threadCount, uinta maxPriority, const Options *opts)
+    {
+    assert(threadCount);
+    assert(maxPriority < PriorityBitmap::BITS*PriorityBitmap::BITS);
+    minThreads = liveThreads = threadCount;
+    maxThreads = opts->maxThreads ? opts->maxThreads : 2*threadCount;
+    assert(maxThreads >= minThreads);
+    blockingThreads = 0;
+    autoScale = opts->autoScale;
+    spawning = NO;
+    idleRetireMicros = opts->idleRetireMicros;
+    this->maxPriority = maxPriority;
+    quantumTasks = opts->quantumTasks ? opts->quantumTasks : 1;
+    quantumMicros = opts->quantumMicros;
+    spinMicros = opts->spinMicros;
+    numaAware = opts->numaAware;
+    fairShare = opts->fairShare;
+    deadlockHandler = opts->deadlockHandler;
+    deadlockScanMicros = deadlockHandler ? opts->deadlockScanMicros : 0;
+    lockAgingMicros = opts->lockAgingMicros;
+    trackWaiters = deadlockHandler || lockAgingMicros;
+    waitingLoopers = lastWaitingLooper = 0;
+    waiterCheckDue = deadlockScanDue = TIMER_NEVER;
+    deadlockMark = 0;
+    deadlockStack = deadlockLoopers = 0;
+    deadlockLocks = 0;
+    deadlockCapacity = 0;
+    initNodes(opts);
+    pins = opts->cpuSetCount || numaAware ? new cpu_set_t[maxThreads] : 0;
+    workers = new Worker*[maxThreads];
+    uinta nextNode = 0;
+    for (uinta i = 0; i < maxThreads; i++)
+        {
+        NumaNode *node = nodes;
+        if (i >= minThreads)
+            {
+            node = workers[i%minThreads]->node;
+            if (pins) pins[i] = pins[i%minThreads];
+            }
+        else if (opts->cpuSetCount)
+            {
+            pins[i] = opts->cpuSets[i%opts->cpuSetCount];
+            if (numaAware)
+                for (uinta cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                    if (CPU_ISSET(cpu, pins + i))
+                        {
+                        node = nodes + cpuNodes[cpu];
+                        break;
+                        }
+            }
+        else if (numaAware)
+            {
+            while (!CPU_COUNT(&nodes[nextNode%numaNodeCount].cpus)) nextNode++;
+            node = nodes + nextNode++%numaNodeCount;
+            pins[i] = node->cpus;
+            }
+        Worker *w = workers[i] = (Worker*)allocInternal(sizeof(Worker), node);
+        w->controller = this;
+        w->node = node;
+        w->nextParked = 0;
+        w->index = i;
+        w->nodeIndex = i >= minThreads ? workers[i%minThreads]->nodeIndex : opts->workStealing ? node->workerCount : 0;
+        w->spinMicros = spinMicros;
+        w->runNext = 0;
+        w->taskCache = 0;
+        w->taskCacheCount = 0;
+        w->ring = 0;
+        w->resumed = 0;
+        w->affinityHits = 0;
+        w->tasksRun = 0;
+        w->graceSnapshot = 0;
+        w->parked = 0;
+        w->running = NO;
+        w->polling = NO;
+        w->live = i < minThreads;
+        w->blocking = NO;
+        w->graceWaiting = NO;
+        if (w->live) node->workerCount++;
+        }
+    queueCount = 0;
+    for (uinta i = 0; i < numaNodeCount; i++)
+        {
+        NumaNode *node = nodes + i;
+        node->queueCount = opts->workStealing || !node->workerCount ? node->workerCount : 1;
+        node->queues = new ReadyQueue*[node->queueCount];
+        for (uinta j = 0; j < node->queueCount; j++)
+            {
+            ReadyQueue *q = node->queues[j] = (ReadyQueue*)allocInternal(sizeof(ReadyQueue), node);
+            FairHeap *heaps = opts->fairShare ? (FairHeap*)allocInternal((maxPriority + 1)*sizeof(FairHeap), node) : 0;
+            q->init(maxPriority, (DList<Looper>*)allocInternal((maxPriority + 1)*sizeof(DList<Looper>), node), heaps);
+            }
+        queueCount += node->queueCount;
+        node->lockPool = new NodePool();
+        node->lockPool->init(sizeof(LockWaiters) + (maxPriority + 1)*sizeof(LockQHdr), numaAware ? (inta)i : -1);
+        node->taskPool = new NodePool();
+        node->taskPool->init(TASK_BLOCK_SIZE, numaAware ? (inta)i : -1);
+        }
+    queues = new ReadyQueue*[queueCount];
+    for (uinta i = 0, k = 0; i < numaNodeCount; i++) for (uinta j = 0; j < nodes[i].queueCount; j++) queues[k++] = nodes[i].queues[j];
+    for (uinta i = 0; i < maxThreads; i++) workers[i]->queue = workers[i]->node->queues[workers[i]->nodeIndex];
+    waitingThreadCount = 0;
+    parkedWorkers = 0;
+    stopTheWorld = NO;
+    specialLooper = new Looper();
+    stoppedGroups = 0;
+    stoppedGroupCount = 0;
+    mutex = PTHREAD_MUTEX_INITIALIZER;
+    parkMutex = PTHREAD_MUTEX_INITIALIZER;
+    timerTickMicros = opts->timerTickMicros ? opts->timerTickMicros : 1;
+    timers = new TimerWheel();
+    timers->init(monotonicMicros()/timerTickMicros);
+    timerDue = TIMER_NEVER;
+    timekeeper = 0;
+    timerMutex = PTHREAD_MUTEX_INITIALIZER;
+    epollFd = wakeFd = -1;
+    ioWatchCount = 0;
+    ioMutexWaiters = 0;
+    ioPollMicros = opts->ioPollMicros;
+    ioPollDue = 0;
+    ioMutex = PTHREAD_MUTEX_INITIALIZER;
+    foreignRing = 0;
+    ioBuffers = 0;
+    ioBufferCount = 0;
+    ioRingEntries = opts->ioRingEntries ? opts->ioRingEntries : 1;
+    ioUring = opts->ioUring;
+    ioStarted = NO;
+    ringMutex = PTHREAD_MUTEX_INITIALIZER;
+    offloadFirst = offloadLast = 0;
+    offloadThreads = opts->ioOffloadThreads ? opts->ioOffloadThreads : 1;
+    offloadRunning = NO;
+    offloadMutex = PTHREAD_MUTEX_INITIALIZER;
+    offloadCond = PTHREAD_COND_INITIALIZER;
+    graceTasks = graceNext = 0;
+    graceRemaining = 0;
+    gracePending = NO;
+    graceRecheck = NO;
+    graceMutex = PTHREAD_MUTEX_INITIALIZER;
+    for (uinta i = 0; i < minThreads; i++) startThread(workers[i]);
+    }
+
+// Finds the NUMA nodes and their CPUs (restricted to those the process may use)
+// if Options::numaAware is set, otherwise there's just a single node.
+void Controller::initNodes(const Options *opts)
+    {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) CPU_ZERO(&allowed);
+    cpu_set_t online;
+    numaNodeCount = 1;
+    if (numaAware && readSysList("/sys/devices/system/node/online", &online))
+        for (uinta i = 0; i < CPU_SETSIZE; i++) if (CPU_ISSET(i, &online)) numaNodeCount = i + 1;
+    nodes = new NumaNode[numaNodeCount];
+    cpuNodes = numaAware ? new uint16[CPU_SETSIZE]() : 0;
+    bool anyCpus = NO;
+    for (uinta i = 0; i < numaNodeCount; i++)
+        {
+        NumaNode *node = nodes + i;
+        node->index = i;
+        node->workerCount = 0;
+        node->queues = 0;
+        node->queueCount = 0;
+        node->lockPool = 0;
+        node->taskPool = 0;
+        char path[64];
+        sprintf(path, "/sys/devices/system/node/node%u/cpulist", (unsigned int)i);
+        if (!numaAware)
+            node->cpus = allowed;
+        else if (readSysList(path, &node->cpus))
+            CPU_AND(&node->cpus, &node->cpus, &allowed);
+        if (CPU_COUNT(&node->cpus)) anyCpus = YES;
+        if (cpuNodes) for (uinta cpu = 0; cpu < CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, &node->cpus)) cpuNodes[cpu] = i;
+        }
+    if (!anyCpus) nodes[0].cpus = allowed;
+    }
+
+// Controller internals belonging to a node are mapped on that node when the
+// Controller's NUMA aware, and otherwise just allocated cache line aligned.
+void *Controller::allocInternal(uinta size, NumaNode *node)
+    {
+    if (numaAware) return mapOnNode(pageAlign(size), node->index);
+    void *mem;
+    assert(!posix_memalign(&mem, 64, size));
+    return mem;
+    }
+
+NumaNode *Controller::callerNode()
+    {
+    if (!numaAware) return 0;
+    Worker *w = currentWorker;
+    if (w && w->controller == this) return w->node;
+    const int cpu = sched_getcpu();
+    return nodes + (cpu >= 0 && cpu < CPU_SETSIZE ? cpuNodes[cpu] : 0);
+    }
+
+// Pooled tasks come from the worker's own cache, which is refilled from its
+// node's pool, and spilled back to it, a batch at a time, so the pool's mutex is
+// rarely taken. A task's often freed by a different worker from the one that
+// allocated it, so caches fill up on some workers and drain on others. Threads
+// other than the workers use the pool directly.
+void *Controller::allocTask()
+    {
+    Worker *w = currentWorker;
+    if (!w || w->controller != this)
+        {
+        NumaNode *node = callerNode();
+        return (node ? node : nodes)->taskPool->alloc();
+        }
+    if (!w->taskCache)
+        {
+        w->taskCache = w->node->taskPool->allocList(TASK_CACHE_BATCH);
+        w->taskCacheCount = TASK_CACHE_BATCH;
+        }
+    void *block = w->taskCache;
+    w->taskCache = *(void**)block;
+    w->taskCacheCount--;
+    return block;
+    }
+
+void Controller::freeTask(void *block)
+    {
+    Worker *w = currentWorker;
+    if (!w || w->controller != this)
+        {
+        NumaNode *node = callerNode();
+        (node ? node : nodes)->taskPool->free(block);
+        return;
+        }
+    if (w->taskCacheCount == 2*TASK_CACHE_BATCH)
+        {
+        void *first = w->taskCache;
+        void *last = first;
+        for (uinta i = 1; i < TASK_CACHE_BATCH; i++) last = *(void**)last;
+        w->taskCache = *(void**)last;
+        w->taskCacheCount -= TASK_CACHE_BATCH;
+        w->node->taskPool->freeList(first, last);
+        }
+    *(void**)block = w->taskCache;
+    w->taskCache = block;
+    w->taskCacheCount++;
+    }
+
+// The Task may not be the first base of its class, so its block's found before
+// it's destroyed.
+void Controller::deleteTask(Task *t)
+    {
+    freeSides(t);
+    if (!t->mtllPooled)
+        {
+        delete t;
+        return;
+        }
+    void *block = dynamic_cast<void*>(t);
+    t->~Task();
+    freeTask(block);
+    }
+
+template<class S>
+S *Controller::newSide()
+    {
+    static_assert(sizeof(S) <= TASK_BLOCK_SIZE);
+    S *side = new (allocTask()) S();
+    Worker *w = currentWorker;
+    side->pool = (w && w->controller == this ? w->node : nodes)->taskPool;
+    return side;
+    }
+
+// The side state goes back through the worker's cache, like the Task's block.
+void Controller::freeSides(Task *t)
+    {
+    if (t->mtllTimer) freeTask(t->mtllTimer);
+    if (t->mtllIo) freeTask(t->mtllIo);
+    if (t->mtllLocks)
+        {
+        t->mtllLocks->~TaskLocks();
+        freeTask(t->mtllLocks);
+        }
+    t->mtllTimer = 0;
+    t->mtllIo = 0;
+    t->mtllLocks = 0;
+    }
+
+void Controller::startThread(Worker *w)
+    {
+    pthread_t thd;
+    pthread_attr_t attr;
+    assert(!pthread_attr_init(&attr));
+    assert(!pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+    if (pins) assert(!pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), pins + w->index));
+    assert(!pthread_create(&thd, &attr, mtllStartThread, w));
+    pthread_attr_destroy(&attr);
+    }
+
+// The first minThreads workers always have a thread, the rest are started as
+// needed and retire again after they've been idle for idleRetireMicros. Extra
+// workers share the ready queue of one of the first minThreads workers.
+void Controller::addWorker()
+    {
+    Worker *w = 0;
+    takeParkMutex();
+    for (uinta i = minThreads; i < maxThreads && !w; i++) if (!workers[i]->live) w = workers[i];
+    if (w)
+        {
+        w->live = YES;
+        atomicIncrement(&liveThreads);
+        atomicStore(&spawning, YES);
+        }
+    releaseParkMutex();
+    if (w) startThread(w);
+    }
+
+void Controller::runPoolThread(Worker *w)
+    {
+    currentWorker = w;
+    atomicStore(&spawning, NO);
+    for ( ; ; )
+        {
+        Looper *lpr = fetchNextReadyLooper(w);
+        if (lpr)
+            runLooperTask(w, lpr);
+        else if (!park(w))
+            return;
+        }
+    }
+
+// Returns with w->running set if it found a looper. The running flags stand in
+// for a count of running threads, each worker only ever writes its own, so
+// dispatching a task doesn't bounce a shared cache line between the workers.
+// Whichever worker clears its flag last after Stop the World's been requested
+// notices and runs the special looper itself.
+Looper *Controller::fetchNextReadyLooper(Worker *w)
+    {
+    for ( ; ; )
+        {
+        IoRing *ring = w->ring;
+        if (ring)
+            {
+            flushRing(ring);
+            if (ring->completions()) wakeWorkers(reapRing(ring));
+            }
+        const uint64 due = __atomic_load_n(&timerDue, __ATOMIC_RELAXED);
+        const uint64 checkDue = __atomic_load_n(&waiterCheckDue, __ATOMIC_RELAXED);
+        const bool watching = relaxedLoad(&ioWatchCount) != 0;
+        if (due != TIMER_NEVER || checkDue != TIMER_NEVER || watching)
+            {
+            const uint64 now = monotonicMicros();
+            if (now >= due) runTimers();
+            if (now >= checkDue) checkWaiters(now);
+            if (watching && now >= __atomic_load_n(&ioPollDue, __ATOMIC_RELAXED)) pollIo(0, 0);
+            }
+        if (atomicLoad(&stopTheWorld))
+            {
+            if (!runStopTheWorld()) return 0;
+            continue;
+            }
+        atomicStore(&w->running, YES);
+        if (relaxedLoad(&stoppedGroupCount) && !atomicLoad(&stopTheWorld)) runStoppedGroup(w);
+        Looper *lpr = atomicLoad(&stopTheWorld) ? 0 : popReadyLooper(w);
+        if (lpr)
+            {
+            // Whoever made the loopers still queued here woke a worker for each of
+            // them, so none's woken here, which would chain wake the pool.
+            if (autoScale && !atomicLoad(&waitingThreadCount) && atomicLoad(&w->queue->count) > 1 && !atomicLoad(&spawning) && relaxedLoad(&liveThreads) < maxThreads)
+                addWorker();
+            if (lpr->lastWorker)
+                {
+                relaxedStore(&w->resumed, w->resumed + 1);
+                if (lpr->lastWorker == w) relaxedStore(&w->affinityHits, w->affinityHits + 1);
+                }
+            lpr->lastWorker = w;
+            return lpr;
+            }
+        atomicStore(&w->running, NO);
+        if (atomicLoad(&gracePending)) checkQuiescence();
+        if (!atomicLoad(&stopTheWorld)) return 0;
+        }
+    }
+
+// Takes the looper in the worker's runnext slot, unless there's a higher
+// priority looper ready on its node. Otherwise takes the highest priority
+// looper from the worker's own queue, unless another queue on the same node
+// has a higher priority looper ready, in which case it's stolen from there.
+// Loopers are only stolen from other nodes' queues, and then from other
+// workers' runnext slots, when there's nothing ready on this worker's node.
+Looper *Controller::popReadyLooper(Worker *w)
+    {
+    ReadyQueue *victim = w->queue;
+    inta best = relaxedLoad(&victim->top);
+    NumaNode *node = w->node;
+    if (best < (inta)maxPriority)
+        for (uinta i = 1; i < node->queueCount; i++)
+            {
+            ReadyQueue *q = node->queues[(w->nodeIndex + i)%node->queueCount];
+            const inta top = relaxedLoad(&q->top);
+            if (top > best)
+                {
+                best = top;
+                victim = q;
+                }
+            }
+    if (atomicLoad(&w->runNext))
+        {
+        Looper *lpr = atomicExchange(&w->runNext);
+        if (lpr)
+            {
+            if ((inta)lpr->tasks.front()->mtllPrio >= best) return lpr;
+            pushReady(lpr);
+            best = relaxedLoad(&victim->top);
+            }
+        }
+    for (uinta n = 1; best < 0 && n < numaNodeCount; n++)
+        {
+        NumaNode *other = nodes + (node->index + n)%numaNodeCount;
+        for (uinta i = 0; i < other->queueCount; i++)
+            {
+            ReadyQueue *q = other->queues[(w->index + i)%other->queueCount];
+            const inta top = relaxedLoad(&q->top);
+            if (top > best)
+                {
+                best = top;
+                victim = q;
+                }
+            }
+        }
+    if (best < 0)
+        {
+        for (uinta i = 1; i < maxThreads; i++)
+            {
+            Worker *other = workers[(w->index + i)%maxThreads];
+            if (atomicLoad(&other->runNext))
+                {
+                Looper *lpr = atomicExchange(&other->runNext);
+                if (lpr) return lpr;
+                }
+            }
+        return 0;
+        }
+    victim->takeMutex();
+    Looper *lpr = victim->pop();
+    victim->releaseMutex();
+    return lpr;
+    }
+
+// Runs tasks from the looper until it runs out of tasks, or its next task needs
+// a lock, or its quantum's used up, or there's something more urgent to do.
+void Controller::runLooperTask(Worker *w, Looper *lpr)
+    {
+    LooperGroup *group = lpr->group;
+    if (group && !enterGroup(lpr))
+        {
+        atomicStore(&w->running, NO);
+        if (atomicLoad(&gracePending)) checkQuiescence();
+        return;
+        }
+    bool deleted = NO;
+    const uinta lprQuantumTasks = relaxedLoad(&lpr->quantumTasks);
+    const uinta lprQuantumMicros = relaxedLoad(&lpr->quantumMicros);
+    const uinta maxTasks = lprQuantumTasks ? lprQuantumTasks : quantumTasks;
+    const uinta micros = lprQuantumMicros ? lprQuantumMicros : quantumMicros;
+    const uint64 deadline = micros ? monotonicMicros() + micros : 0;
+    uint64 started = fairShare ? monotonicNanos() : 0;
+    for (uinta taskCount = 1; ; taskCount++)
+        {
+        Task *t = lpr->tasks.pop();
+        if (t->mtllLocks) t->mtllLocks->count = 0;
+        t->mtllUpgrade = NO;
+        __atomic_store_n(&lpr->runningTaskPriority, t->mtllPrio, __ATOMIC_RELAXED);
+        __atomic_store_n(&lpr->taskRunning, YES, __ATOMIC_RELEASE);
+        const bool deleteAfterwards = t->mtllDeleteAfterwards;
+        const bool periodic = t->mtllTimer && t->mtllTimer->period;
+        IoWatch *watch = t->mtllIo ? t->mtllIo->watch : 0;
+        if (watch) t->mtllIo->events = __atomic_fetch_and(&watch->state, IO_QUEUED | IO_DEAD, __ATOMIC_SEQ_CST) & IO_EVENTS;
+        t->mtllRun(this, lpr);
+        if (periodic)
+            rearmTimer(t);
+        else if (watch)
+            ioTaskDone(watch);
+        else if (deleteAfterwards)
+            deleteTask(t);
+        __atomic_store_n(&lpr->taskRunning, NO, __ATOMIC_RELEASE);
+        __atomic_store_n(&w->tasksRun, w->tasksRun + 1, __ATOMIC_RELEASE);
+        if (__atomic_load_n(&gracePending, __ATOMIC_RELAXED)) checkQuiescence();
+        // The looper's charged before it can be made ready again, or go idle.
+        if (fairShare)
+            {
+            const uint64 now = monotonicNanos();
+            __atomic_store_n(&lpr->runNanos, lpr->runNanos + now - started, __ATOMIC_RELAXED);
+            lpr->vruntime += ((now - started) << FAIR_WEIGHT_SHIFT)/relaxedLoad(&lpr->weight);
+            started = now;
+            }
+        const uinta remaining = atomicDecrement(&lpr->pending);
+        if (!(remaining & ~LOOPER_DELETE_BIT))
+            {
+            if (remaining)
+                {
+                takeMutex();
+                const uinta readyCount = finalizeAndDelete(lpr);
+                releaseMutex();
+                wakeWorkers(readyCount);
+                deleted = YES;
+                }
+            break;
+            }
+        Task *next = lpr->tasks.front();
+        if (next->mtllLock)
+            {
+            takeMutex();
+            waitForLockOrMakeReady(lpr);
+            releaseMutex();
+            break;
+            }
+        if (taskCount >= maxTasks || (deadline && monotonicMicros() >= deadline) || atomicLoad(&stopTheWorld) || (group && atomicLoad(&group->stopping)) || higherPriorityReady(w, next->mtllPrio))
+            {
+            pushReady(lpr);
+            break;
+            }
+        }
+    if (group)
+        {
+        leaveGroup(group);
+        if (deleted) releaseGroup(group, 1);
+        }
+    atomicStore(&w->running, NO);
+    if (atomicLoad(&gracePending)) checkQuiescence();
+    }
+
+bool Controller::higherPriorityReady(Worker *w, uinta priority)
+    {
+    NumaNode *node = w->node;
+    for (uinta i = 0; i < node->queueCount; i++) if (relaxedLoad(&node->queues[i]->top) > (inta)priority) return YES;
+    return NO;
+    }
+
+bool Controller::runStopTheWorld()
+    {
+    takeMutex();
+    if (specialLooper->taskRunning || anyWorkerRunning())
+        {
+        releaseMutex();
+        return NO;
+        }
+    while (specialLooper->tasks.first())
+        {
+        Task *t = specialLooper->tasks.pop();
+        atomicStore(&specialLooper->taskRunning, YES);
+        const bool deleteAfterwards = t->mtllDeleteAfterwards;
+        releaseMutex();
+        t->mtllRun(this, 0);
+        if (deleteAfterwards) deleteTask(t);
+        takeMutex();
+        atomicStore(&specialLooper->taskRunning, NO);
+        }
+    atomicStore(&stopTheWorld, NO);
+    releaseMutex();
+    wakeAllWorkers();
+    return YES;
+    }
+
+// A worker that takes a looper from a group that's stopping halts it instead
+// of running it. Whichever of the group's loopers stops running last, or
+// enqueueAndStopTheGroup() if none are, hands the group to the workers to run
+// its stop tasks. stopping is set before the running count's read, and a worker
+// reads it after changing the count, so one or other of them notices.
+bool Controller::enterGroup(Looper *lpr)
+    {
+    LooperGroup *g = lpr->group;
+    __atomic_add_fetch(&g->refs, GROUP_RUNNING + 1, __ATOMIC_SEQ_CST);
+    if (!atomicLoad(&g->stopping)) return YES;
+    takeMutex();
+    const bool halt = atomicLoad(&g->stopping);
+    if (halt)
+        {
+        g->halted.linkLast(lpr);
+        g->haltedCount++;
+        }
+    releaseMutex();
+    if (!halt) return YES;
+    leaveGroup(g);
+    return NO;
+    }
+
+// The running looper's reference is kept until the group's been checked.
+void Controller::leaveGroup(LooperGroup *g)
+    {
+    if (__atomic_sub_fetch(&g->refs, GROUP_RUNNING, __ATOMIC_SEQ_CST) < GROUP_RUNNING && atomicLoad(&g->stopping))
+        {
+        takeMutex();
+        const bool schedule = atomicLoad(&g->stopping) && !g->stopScheduled && atomicLoad(&g->refs) < GROUP_RUNNING;
+        if (schedule) scheduleGroupStop(g);
+        releaseMutex();
+        if (schedule) wakeWorkers();
+        }
+    releaseGroup(g, 1);
+    }
+
+void Controller::scheduleGroupStop(LooperGroup *g)
+    {
+    g->stopScheduled = YES;
+    atomicIncrement(&g->refs);
+    g->nextStopped = stoppedGroups;
+    stoppedGroups = g;
+    atomicIncrement(&stoppedGroupCount);
+    }
+
+// Runs a stopped group's tasks 1 at a time, including any queued meanwhile,
+// then makes the loopers that were halted ready again.
+void Controller::runStoppedGroup(Worker *w)
+    {
+    takeMutex();
+    LooperGroup *g = stoppedGroups;
+    if (!g)
+        {
+        releaseMutex();
+        return;
+        }
+    stoppedGroups = g->nextStopped;
+    atomicDecrement(&stoppedGroupCount);
+    for (Task *t; (t = g->stopTasks.unlinkFirst()); )
+        {
+        const bool deleteAfterwards = t->mtllDeleteAfterwards;
+        releaseMutex();
+        t->mtllRun(this, 0);
+        if (deleteAfterwards) deleteTask(t);
+        __atomic_store_n(&w->tasksRun, w->tasksRun + 1, __ATOMIC_RELEASE);
+        takeMutex();
+        }
+    g->stopScheduled = NO;
+    atomicStore(&g->stopping, NO);
+    const uinta readyCount = g->haltedCount;
+    g->haltedCount = 0;
+    makeReady(&g->halted, readyCount);
+    releaseMutex();
+    wakeWorkers(readyCount);
+    releaseGroup(g, 1);
+    }
+
+void Controller::addMember(LooperGroup *g, Looper *lpr)
+    {
+    atomicIncrement(&g->refs);
+    takeMutex();
+    lpr->groupNext = g->members;
+    if (g->members) g->members->groupPrev = lpr;
+    g->members = lpr;
+    releaseMutex();
+    }
+
+void Controller::releaseGroup(LooperGroup *g, uinta count)
+    {
+    if (!__atomic_sub_fetch(&g->refs, count, __ATOMIC_SEQ_CST)) delete g;
+    }
+
+bool Controller::anyWorkerRunning()
+    {
+    for (uinta i = 0; i < maxThreads; i++) if (atomicLoad(&workers[i]->running)) return YES;
+    return NO;
+    }
+
+bool Controller::workVisible()
+    {
+    if (atomicLoad(&stopTheWorld)) return !atomicLoad(&specialLooper->taskRunning) && !anyWorkerRunning();
+    for (uinta i = 0; i < queueCount; i++) if (atomicLoad(&queues[i]->count)) return YES;
+    for (uinta i = 0; i < maxThreads; i++) if (atomicLoad(&workers[i]->runNext)) return YES;
+    if (atomicLoad(&stoppedGroupCount)) return YES;
+    return NO;
+    }
+
+// Each parked worker sleeps on its own futex, and waking it means taking it off
+// the stack of parked workers and clearing its futex word. So a waker wakes
+// exactly the workers it needs to, all at once, and no others. Before parking
+// a worker may spin for a while. The spin time adapts, it's lengthened when a
+// worker's woken soon after parking, and shortened when it sleeps longer.
+bool Controller::park(Worker *w)
+    {
+    if (spinForWork(w)) return YES;
+    takeParkMutex();
+    w->nextParked = parkedWorkers;
+    parkedWorkers = w;
+    __atomic_store_n(&w->parked, 1, __ATOMIC_RELAXED);
+    atomicIncrement(&waitingThreadCount);
+    releaseParkMutex();
+    if (workVisible() && unparkSelf(w)) return YES;
+    const bool retirable = w->index >= minThreads;
+    const uint64 parkedAt = spinMicros || retirable ? monotonicMicros() : 0;
+    uint64 idleSince = parkedAt;
+    bool keepingTime = NO;
+    while (__atomic_load_n(&w->parked, __ATOMIC_ACQUIRE))
+        {
+        if (!keepingTime && (nextDue() != TIMER_NEVER || atomicLoad(&ioWatchCount))) keepingTime = keepTime(w);
+        const uint64 due = keepingTime ? nextDue() : TIMER_NEVER;
+        uint64 now = 0;
+        if (due != TIMER_NEVER || retirable)
+            {
+            now = monotonicMicros();
+            if (due <= now)
+                {
+                if (unparkSelf(w))
+                    {
+                    stopKeepingTime(w, NO);
+                    return YES;
+                    }
+                continue;
+                }
+            if (retirable && now - idleSince >= idleRetireMicros)
+                {
+                // The worker mustn't be touched once it's retired, so it gives
+                // up keeping time first, and another parked worker's nudged to
+                // take over once it's off the parked stack.
+                const bool keptTime = keepingTime;
+                if (keepingTime)
+                    {
+                    stopKeepingTime(w, NO);
+                    keepingTime = NO;
+                    }
+                if (retire(w))
+                    {
+                    if (keptTime && (nextDue() != TIMER_NEVER || atomicLoad(&ioWatchCount))) nudgeParked();
+                    return NO;
+                    }
+                idleSince = now;
+                }
+            }
+        uint64 wakeAt = due;
+        if (retirable && idleSince + idleRetireMicros < wakeAt) wakeAt = idleSince + idleRetireMicros;
+        if (keepingTime && atomicLoad(&ioWatchCount))
+            {
+            if (!pollIo(w, wakeAt)) futexWaitMicros(&w->parked, 1, ioPollMicros);
+            }
+        else if (wakeAt == TIMER_NEVER)
+            futexWait(&w->parked, 1);
+        else
+            futexWaitMicros(&w->parked, 1, wakeAt - now);
+        }
+    if (keepingTime) stopKeepingTime(w, YES);
+    if (spinMicros)
+        {
+        if (monotonicMicros() - parkedAt < spinMicros)
+            w->spinMicros = 2*w->spinMicros + 1 < spinMicros ? 2*w->spinMicros + 1 : spinMicros;
+        else
+            w->spinMicros /= 2;
+        }
+    return YES;
+    }
+
+// While timers are armed, file descriptors watched or the waiters' check's due,
+// 1 parked worker keeps time, sleeping only until the next timer's due, and
+// waiting in epoll rather than on its futex if there are watches. The others
+// sleep until they're woken. A worker that
+// stops keeping time for any reason other than the timers being due nudges
+// another parked worker to take over, because the timers might otherwise wait
+// for a busy worker's next task.
+bool Controller::keepTime(Worker *w)
+    {
+    Worker *expected = 0;
+    return __atomic_compare_exchange_n(&timekeeper, &expected, w, NO, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    }
+
+void Controller::stopKeepingTime(Worker *w, bool nudge)
+    {
+    Worker *expected = w;
+    if (!__atomic_compare_exchange_n(&timekeeper, &expected, (Worker*)0, NO, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return;
+    if (nudge && (nextDue() != TIMER_NEVER || atomicLoad(&ioWatchCount))) nudgeParked();
+    }
+
+// When the timekeeper next needs to wake, for a timer or the waiters' check.
+uint64 Controller::nextDue()
+    {
+    const uint64 due = __atomic_load_n(&timerDue, __ATOMIC_SEQ_CST);
+    const uint64 checkDue = __atomic_load_n(&waiterCheckDue, __ATOMIC_SEQ_CST);
+    return checkDue < due ? checkDue : due;
+    }
+
+// Wakes a parked worker without taking it off the parked stack, so that it
+// goes back to sleep again after checking whether it should keep time.
+void Controller::nudgeParked()
+    {
+    takeParkMutex();
+    Worker *w = parkedWorkers;
+    releaseParkMutex();
+    if (w) futexWake(&w->parked);
+    }
+
+// Rouses the timekeeper so it sees a new timer or starts polling, or if there
+// isn't one nudges a parked worker to take over.
+void Controller::rouseTimekeeper()
+    {
+    Worker *keeper = __atomic_load_n(&timekeeper, __ATOMIC_SEQ_CST);
+    if (keeper)
+        rouse(keeper);
+    else if (atomicLoad(&waitingThreadCount))
+        nudgeParked();
+    }
+
+// Wakes a worker that may be waiting in epoll rather than on its futex.
+void Controller::rouse(Worker *w)
+    {
+    futexWake(&w->parked);
+    if (atomicLoad(&w->polling)) interruptPoll();
+    }
+
+// The epoll instance is only created when the first fd or ring is watched, so a
+// Controller that does no I/O has no epoll or eventfd descriptors. Nothing polls
+// before then, since ioWatchCount's still 0.
+void Controller::openEpoll()
+    {
+    if (__atomic_load_n(&epollFd, __ATOMIC_ACQUIRE) >= 0) return;
+    assert(!pthread_mutex_lock(&ioMutex));
+    if (epollFd < 0)
+        {
+        wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        assert(wakeFd >= 0);
+        const int fd = epoll_create1(EPOLL_CLOEXEC);
+        assert(fd >= 0);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = 0;
+        const int added = epoll_ctl(fd, EPOLL_CTL_ADD, wakeFd, &ev);
+        assert(!added);
+        (void)added;
+        __atomic_store_n(&epollFd, fd, __ATOMIC_RELEASE);
+        }
+    assert(!pthread_mutex_unlock(&ioMutex));
+    }
+
+void Controller::interruptPoll()
+    {
+    const uint64 one = 1;
+    const ssize_t written = write(wakeFd, &one, sizeof(one));
+    (void)written;
+    }
+
+// Polls for I/O events, and enqueues the tasks watching for them. A parked
+// worker (the sleeper) waits until the time given, or until it's woken, busy
+// workers don't wait at all. Only 1 worker polls at a time, and events are
+// only acted on with ioMutex held, so once unwatch() has taken ioMutex and
+// removed a watch from epoll nothing will use the watch again. Returns NO if
+// another worker's polling, or if unwatch() is waiting for ioMutex.
+bool Controller::pollIo(Worker *sleeper, uint64 until)
+    {
+    if (atomicLoad(&ioMutexWaiters) || pthread_mutex_trylock(&ioMutex)) return NO;
+    int timeout = 0;
+    if (sleeper)
+        {
+        atomicStore(&sleeper->polling, YES);
+        if (!__atomic_load_n(&sleeper->parked, __ATOMIC_SEQ_CST))
+            timeout = 0;
+        else if (until == TIMER_NEVER)
+            timeout = -1;
+        else
+            {
+            const uint64 now = monotonicMicros();
+            timeout = until > now ? (until - now + 999)/1000 : 0;
+            }
+        }
+    struct epoll_event events[64];
+    const int count = epoll_wait(epollFd, events, 64, timeout);
+    if (sleeper) atomicStore(&sleeper->polling, NO);
+    uinta readyCount = 0;
+    for (int i = 0; i < count; i++)
+        {
+        IoWatch *watch = (IoWatch*)events[i].data.ptr;
+        if (!watch || watch->ring)
+            {
+            uint64 value;
+            const ssize_t got = read(watch ? watch->ring->eventFd : wakeFd, &value, sizeof(value));
+            (void)got;
+            if (watch) readyCount += reapRing(watch->ring);
+            continue;
+            }
+        const uint32 old = __atomic_fetch_or(&watch->state, (events[i].events & IO_EVENTS) | IO_QUEUED, __ATOMIC_SEQ_CST);
+        if (!(old & IO_QUEUED) && submitTask(watch->lpr, watch->task)) readyCount++;
+        }
+    __atomic_store_n(&ioPollDue, monotonicMicros() + ioPollMicros, __ATOMIC_RELAXED);
+    assert(!pthread_mutex_unlock(&ioMutex));
+    wakeWorkers(readyCount);
+    return YES;
+    }
+
+bool Controller::spinForWork(Worker *w)
+    {
+    if (!w->spinMicros) return NO;
+    const uint64 deadline = monotonicMicros() + w->spinMicros;
+    do
+        {
+        for (uinta i = 0; i < 64; i++)
+            {
+            if (workVisible()) return YES;
+            cpuRelax();
+            }
+        }
+    while (monotonicMicros() < deadline);
+    return NO;
+    }
+
+// A worker that's pushed itself on the parked stack and then seen work arrive
+// takes itself off again, unless a waker's got to it first.
+bool Controller::unparkSelf(Worker *w)
+    {
+    takeParkMutex();
+    Worker **link = &parkedWorkers;
+    while (*link && *link != w) link = &(*link)->nextParked;
+    const bool found = *link != 0;
+    if (found)
+        {
+        *link = w->nextParked;
+        atomicDecrement(&waitingThreadCount);
+        __atomic_store_n(&w->parked, 0, __ATOMIC_RELAXED);
+        }
+    releaseParkMutex();
+    return found;
+    }
+
+// Parked workers with a looper waiting in their runnext slot are woken first.
+// An extra worker that's been parked for the idle timeout retires, unless a
+// waker's got to it first or it's making up for a blocked worker. Its thread
+// mustn't touch the worker after clearing live, the worker may be reused.
+bool Controller::retire(Worker *w)
+    {
+    takeParkMutex();
+    Worker **link = &parkedWorkers;
+    while (*link && *link != w) link = &(*link)->nextParked;
+    const bool retiring = *link && liveThreads - blockingThreads > minThreads;
+    if (retiring)
+        {
+        *link = w->nextParked;
+        atomicDecrement(&waitingThreadCount);
+        __atomic_store_n(&w->parked, 0, __ATOMIC_RELAXED);
+        }
+    releaseParkMutex();
+    if (!retiring) return NO;
+    if (atomicLoad(&w->runNext))
+        {
+        Looper *lpr = atomicExchange(&w->runNext);
+        if (lpr)
+            {
+            pushReady(lpr);
+            wakeWorkers();
+            }
+        }
+    takeParkMutex();
+    w->live = NO;
+    atomicDecrement(&liveThreads);
+    releaseParkMutex();
+    return YES;
+    }
+
+// A task that's about to block its thread calls this first. If there aren't
+// then enough unblocked threads, and no idle ones, an extra worker's started.
+void Controller::beginBlocking()
+    {
+    Worker *w = currentWorker;
+    if (!w || w->controller != this) return;
+    assert(!w->blocking);
+    w->blocking = YES;
+    if (atomicLoad(&w->runNext))
+        {
+        Looper *lpr = atomicExchange(&w->runNext);
+        if (lpr) pushReady(lpr);
+        }
+    takeParkMutex();
+    blockingThreads++;
+    const bool grow = !parkedWorkers && liveThreads - blockingThreads < minThreads;
+    releaseParkMutex();
+    if (grow)
+        addWorker();
+    else if (workVisible())
+        wakeWorkers();
+    }
+
+void Controller::endBlocking()
+    {
+    Worker *w = currentWorker;
+    if (!w || w->controller != this) return;
+    assert(w->blocking);
+    w->blocking = NO;
+    takeParkMutex();
+    blockingThreads--;
+    releaseParkMutex();
+    }
+
+void Controller::wakeWorkers(uinta n)
+    {
+    if (!n || !atomicLoad(&waitingThreadCount)) return;
+    Worker *woken = 0;
+    takeParkMutex();
+    for (Worker **link = &parkedWorkers; n && *link; )
+        {
+        Worker *w = *link;
+        if (atomicLoad(&w->runNext))
+            {
+            *link = w->nextParked;
+            w->nextParked = woken;
+            woken = w;
+            atomicDecrement(&waitingThreadCount);
+            n--;
+            }
+        else
+            link = &w->nextParked;
+        }
+    while (n-- && parkedWorkers)
+        {
+        Worker *w = parkedWorkers;
+        parkedWorkers = w->nextParked;
+        w->nextParked = woken;
+        woken = w;
+        atomicDecrement(&waitingThreadCount);
+        }
+    releaseParkMutex();
+    while (woken)
+        {
+        Worker *next = woken->nextParked;
+        __atomic_store_n(&woken->parked, 0, __ATOMIC_SEQ_CST);
+        rouse(woken);
+        woken = next;
+        }
+    }
+
+void Controller::wakeAllWorkers()
+    {
+    wakeWorkers(maxThreads);
+    }
+
+// Pool threads make loopers ready on their own queue, other threads spread
+// them round robin over all the queues. Except that loopers with a home node
+// always go on one of their home node's queues.
+ReadyQueue *Controller::readyQueueFor(Looper *lpr)
+    {
+    Worker *w = currentWorker;
+    const inta home = relaxedLoad(&lpr->homeNode);
+    NumaNode *node = home >= 0 && nodes[home].queueCount ? nodes + home : 0;
+    if (w && w->controller == this && (!node || node == w->node)) return w->queue;
+    if (node) return node->queues[nextForeignQueue++%node->queueCount];
+    if (queueCount == 1) return queues[0];
+    return queues[nextForeignQueue++%queueCount];
+    }
+
+bool Controller::waitForLockOrMakeReady(Looper *lpr)
+    {
+    if (!acquireLockOrWait(lpr)) return NO;
+    makeReady(lpr);
+    return YES;
+    }
+
+// Returns YES if the looper's first task can run (because it doesn't request a
+// lock or because the lock's been taken), otherwise the looper's put in the
+// lock's wait queue and NO's returned.
+bool Controller::acquireLockOrWait(Looper *lpr)
+    {
+    Task *t = lpr->tasks.front();
+    Lock *lk = t->mtllLock;
+    uinta mode = t->mtllMode;
+    if (t->mtllUpgrade && lpr->locksHeld.contains(lk)) return attemptUpgradeHM(lpr, t);
+    if (!lk) return YES;
+    if (t->mtllLocks && t->mtllLocks->count ? attemptLocksHM(lpr, t, 0, &lk, &mode) : attemptLockHM(lpr, lk, mode))
+        {
+        assert(parentsHeld(lpr, t));
+        return YES;
+        }
+    waitForLock(lpr, lk, mode);
+    return NO;
+    }
+
+void Controller::waitForLock(Looper *lpr, Lock *lk, uinta mode)
+    {
+    waitersFor(lk);
+    lpr->waitingMode = mode;
+    lpr->waitingPriority = lk->policy == POLICY_FIFO ? 0 : lpr->tasks.front()->mtllPrio;
+    queueWaiter(lk, lpr);
+    if (trackWaiters) startedWaiting(lpr, lk);
+    // The last holder may have let go without the mutex since the lock was tried.
+    // If it was already contended then it's being granted further up the stack.
+    if (!atomicFetchOr(&lk->state, LOCK_CONTENDED)) wakeWorkers(grantWaitersHM(lk));
+    }
+
+// A lock's wait queues come from the pool of the node the first waiter's queued
+// from. They're in the pool's zeroed memory the first time they're used, and
+// they're empty when they're given back, so they only need setting up once.
+LockWaiters *Controller::waitersFor(Lock *lk)
+    {
+    if (lk->waiters) return lk->waiters;
+    NumaNode *node = callerNode();
+    NodePool *pool = (node ? node : nodes)->lockPool;
+    LockWaiters *ws = (LockWaiters*)pool->alloc();
+    if (!ws->priorities)
+        {
+        ws->pool = pool;
+        ws->priorities = (LockQHdr*)(ws + 1);
+        for (uinta i = 0; i <= maxPriority; i++) ws->priorities[i].init();
+        ws->waitingPriorities.init(maxPriority);
+        ws->exclusivePriorities.init(maxPriority);
+        }
+    ws->exclusivePhase = NO;
+    lk->waiters = ws;
+    return ws;
+    }
+
+// Once a contended lock has no waiters or intention holders left its wait queues
+// go back to their pool, and unless it's marked for delete it's no longer
+// contended.
+void Controller::uncontendHM(Lock *lk)
+    {
+    LockWaiters *ws = lk->waiters;
+    if (ws)
+        {
+        if (!ws->waitingPriorities.empty() || ws->upgrader) return;
+        if (ws->intentHolders[0] || ws->intentHolders[1] || ws->intentHolders[2]) return;
+        lk->waiters = 0;
+        ws->pool->free(ws);
+        }
+    if (!(atomicLoad(&lk->state) & LOCK_DELETE)) atomicFetchAnd(&lk->state, ~LOCK_CONTENDED);
+    }
+
+// The upgrader waits outside the lock's queues, to be granted the lock as soon
+// as it's the only holder left. A second upgrader would wait for the first to
+// stop holding the lock, and the first for the second, so its upgrade's refused
+// and its task runs still holding the lock in shared mode.
+bool Controller::attemptUpgradeHM(Looper *lpr, Task *t)
+    {
+    Lock *lk = t->mtllLock;
+    uinta state = atomicLoad(&lk->state);
+    do
+        {
+        if (state & LOCK_EXCLUSIVE) return YES;
+        if ((state & LOCK_HOLDERS) == 1)
+            {
+            if (atomicCompareExchange(&lk->state, &state, state | LOCK_EXCLUSIVE)) return YES;
+            continue;
+            }
+        if (lk->waiters && lk->waiters->upgrader)
+            {
+            t->mtllRefused = YES;
+            return YES;
+            }
+        }
+    while (!atomicCompareExchange(&lk->state, &state, state | LOCK_CONTENDED));
+    waitersFor(lk)->upgrader = lpr;
+    lpr->waitingMode = MODE_X;
+    if (trackWaiters) startedWaiting(lpr, lk);
+    return NO;
+    }
+
+// The waiting list's kept for periodic deadlock scans and for aging, in the order
+// the loopers started waiting. The looper's on it before a deadlock search, which
+// may refuse it. The first looper to wait since the waiters were last checked
+// makes the next check due, and the timekeeper's roused to wake for it.
+void Controller::startedWaiting(Looper *lpr, Lock *lk)
+    {
+    lpr->waitingFor = lk;
+    if (deadlockScanMicros || lockAgingMicros)
+        {
+        lpr->waitingSince = lockAgingMicros ? monotonicMicros() : 0;
+        lpr->waitNext = 0;
+        lpr->waitPrev = lastWaitingLooper;
+        if (lastWaitingLooper)
+            lastWaitingLooper->waitNext = lpr;
+        else
+            waitingLoopers = lpr;
+        lastWaitingLooper = lpr;
+        if (waiterCheckDue == TIMER_NEVER)
+            {
+            if (deadlockScanMicros) deadlockScanDue = monotonicMicros() + deadlockScanMicros;
+            updateWaiterCheckDue();
+            rouseTimekeeper();
+            }
+        }
+    if (deadlockHandler && !deadlockScanMicros) findDeadlock(lpr, NO);
+    }
+
+void Controller::stoppedWaiting(Looper *lpr)
+    {
+    lpr->waitingFor = 0;
+    if (!deadlockScanMicros && !lockAgingMicros) return;
+    if (lpr->waitNext)
+        lpr->waitNext->waitPrev = lpr->waitPrev;
+    else
+        lastWaitingLooper = lpr->waitPrev;
+    if (lpr->waitPrev)
+        lpr->waitPrev->waitNext = lpr->waitNext;
+    else
+        waitingLoopers = lpr->waitNext;
+    }
+
+// Steps through the loopers waiting for the lock, starting with its upgrader.
+Looper *Controller::nextWaiter(Lock *lk, Looper *waiter)
+    {
+    LockWaiters *ws = lk->waiters;
+    inta i;
+    if (!ws) return 0;
+    if (!waiter && ws->upgrader) return ws->upgrader;
+    if (!waiter || waiter == ws->upgrader)
+        i = ws->waitingPriorities.highest();
+    else
+        {
+        if (waiter->mtllPrev) return waiter->mtllPrev;
+        i = ws->waitingPriorities.highestBelow(waiter->waitingPriority);
+        }
+    return i < 0 ? 0 : ws->priorities[i].waiting.first;
+    }
+
+// Searches backwards from the root, through the loopers waiting for locks it
+// holds, then the loopers waiting for locks they hold, and so on. They're in a
+// cycle if any of them holds the lock the root's waiting for. A waiter that
+// could share a lock with its holder is only held up by the holder if it's
+// behind a waiter that couldn't. A periodic scan only reports a cycle from its
+// lowest addressed looper, so it's reported once. Returns YES if the cycle's
+// been broken.
+bool Controller::findDeadlock(Looper *root, bool lowestOnly)
+    {
+    Lock *wanted = root->waitingFor;
+    const uinta mark = ++deadlockMark;
+    root->deadlockMark = mark;
+    root->deadlockParent = 0;
+    uinta depth = 0;
+    uinta seen = 1;
+    growDeadlockBuffers(1);
+    deadlockStack[depth++] = root;
+    while (depth)
+        {
+        Looper *lpr = deadlockStack[--depth];
+        LockSetIterator it;
+        Lock *lk;
+        uinta mode;
+        for (it.init(&lpr->locksHeld); it.next(&lk, &mode); )
+            {
+            if (mode == MODE_S && (atomicLoad(&lk->state) & LOCK_EXCLUSIVE)) mode = MODE_X;
+            bool behind = NO;
+            for (Looper *waiter = nextWaiter(lk, 0); waiter; waiter = nextWaiter(lk, waiter))
+                {
+                if (!behind && (COMPATIBLE_MODES[waiter->waitingMode] & modeBit(mode))) continue;
+                behind = YES;
+                if (waiter->deadlockMark == mark) continue;
+                waiter->deadlockMark = mark;
+                waiter->deadlockParent = lpr;
+                if (waiter->locksHeld.holds(wanted))
+                    {
+                    deadlockLoopers[0] = root;
+                    deadlockLocks[0] = wanted;
+                    uinta count = 1;
+                    for (Looper *x = waiter; x != root; x = x->deadlockParent)
+                        {
+                        if (lowestOnly && (uinta)x < (uinta)root) return NO;
+                        deadlockLoopers[count] = x;
+                        deadlockLocks[count++] = x->waitingFor;
+                        }
+                    const inta victim = deadlockHandler->mtllDeadlock(this, deadlockLoopers, deadlockLocks, count);
+                    if (victim < 0 || (uinta)victim >= count) return NO;
+                    refuseLock(deadlockLoopers[victim]);
+                    return YES;
+                    }
+                growDeadlockBuffers(++seen);
+                deadlockStack[depth++] = waiter;
+                }
+            }
+        }
+    return NO;
+    }
+
+void Controller::growDeadlockBuffers(uinta size)
+    {
+    if (size <= deadlockCapacity) return;
+    const uinta capacity = 2*size;
+    Looper **stack = new Looper*[capacity];
+    for (uinta i = 0; i < deadlockCapacity; i++) stack[i] = deadlockStack[i];
+    delete[] deadlockStack;
+    delete[] deadlockLoopers;
+    delete[] deadlockLocks;
+    deadlockStack = stack;
+    deadlockLoopers = new Looper*[capacity];
+    deadlockLocks = new Lock*[capacity];
+    deadlockCapacity = capacity;
+    }
+
+// Cycles broken during a scan change the waiting list, so it starts again.
+void Controller::scanForDeadlocksHM()
+    {
+    for (Looper *lpr = waitingLoopers; lpr; )
+        lpr = findDeadlock(lpr, YES) ? waitingLoopers : lpr->waitNext;
+    }
+
+// Run by whichever worker first sees that the waiters' check is due. It's only
+// due while loopers are waiting for locks, so until then no worker reads the
+// clock for it.
+void Controller::checkWaiters(uint64 now)
+    {
+    uinta readyCount = 0;
+    takeMutex();
+    if (now >= waiterCheckDue)
+        {
+        if (deadlockScanMicros && now >= deadlockScanDue)
+            {
+            scanForDeadlocksHM();
+            deadlockScanDue = now + deadlockScanMicros;
+            }
+        if (lockAgingMicros) readyCount = ageWaitersHM(now);
+        updateWaiterCheckDue();
+        }
+    releaseMutex();
+    wakeWorkers(readyCount);
+    }
+
+// The check's next due for the next deadlock scan, or for the longest waiting
+// looper's promotion, whichever's sooner.
+void Controller::updateWaiterCheckDue()
+    {
+    uint64 due = TIMER_NEVER;
+    if (waitingLoopers)
+        {
+        if (deadlockScanMicros) due = deadlockScanDue;
+        if (lockAgingMicros && waitingLoopers->waitingSince + lockAgingMicros < due) due = waitingLoopers->waitingSince + lockAgingMicros;
+        }
+    __atomic_store_n(&waiterCheckDue, due, __ATOMIC_SEQ_CST);
+    }
+
+// A looper that's waited Options::lockAgingMicros for a lock, since it started
+// waiting or was last promoted, is moved up to the next priority's queue, where
+// it may be let in straight away. It goes to the back of the waiting list, so
+// the list stays in the order its loopers are due. Returns the number of loopers
+// it's made ready.
+uinta Controller::ageWaitersHM(uint64 now)
+    {
+    uinta readyCount = 0;
+    for (Looper *lpr; (lpr = waitingLoopers) && lpr->waitingSince + lockAgingMicros <= now; )
+        {
+        Lock *lk = lpr->waitingFor;
+        lpr->waitingSince = now;
+        if (lpr != lastWaitingLooper)
+            {
+            waitingLoopers = lpr->waitNext;
+            waitingLoopers->waitPrev = 0;
+            lpr->waitNext = 0;
+            lpr->waitPrev = lastWaitingLooper;
+            lastWaitingLooper->waitNext = lpr;
+            lastWaitingLooper = lpr;
+            }
+        if (lpr == lk->waiters->upgrader || lk->policy == POLICY_FIFO || lpr->waitingPriority == maxPriority) continue;
+        dequeueWaiter(lk, lpr);
+        lpr->waitingPriority++;
+        queueWaiter(lk, lpr);
+        if (atomicLoad(&lk->state) & LOCK_HOLDERS) readyCount += admitWaitersHM(lk);
+        }
+    return readyCount;
+    }
+
+// The refused looper stops waiting, and its task runs without any of the locks
+// it requested. Waiters that were only held back by it are let in. The lock may
+// be being granted further up the stack, so its wait queues are left for its
+// next unlock to give back.
+void Controller::refuseLock(Looper *lpr)
+    {
+    Lock *lk = lpr->waitingFor;
+    LockWaiters *ws = lk->waiters;
+    Task *t = lpr->tasks.front();
+    if (ws->upgrader == lpr)
+        ws->upgrader = 0;
+    else
+        dequeueWaiter(lk, lpr);
+    stoppedWaiting(lpr);
+    t->mtllRefused = YES;
+    makeReady(lpr);
+    uinta readyCount = 1;
+    if (atomicLoad(&lk->state) & LOCK_HOLDERS) readyCount += admitWaitersHM(lk);
+    wakeWorkers(readyCount);
+    }
+
+// Waiters are queued at their priority, exclusive ones ahead of shared ones. A
+// FIFO lock's are all queued at priority 0 in the order they arrive.
+void Controller::queueWaiter(Lock *lk, Looper *lpr)
+    {
+    LockWaiters *ws = lk->waiters;
+    const uinta priority = lpr->waitingPriority;
+    LockQHdr *hdr = ws->priorities + priority;
+    if (lk->policy == POLICY_FIFO)
+        hdr->waiting.linkLast(lpr);
+    else if (modeBit(lpr->waitingMode) & EXCLUSIVE_WAITER_MODES)
+        {
+        hdr->waiting.linkBefore(lpr, hdr->firstShared);
+        ws->exclusivePriorities.set(priority);
+        }
+    else
+        {
+        if (!hdr->firstShared) hdr->firstShared = lpr;
+        hdr->waiting.linkLast(lpr);
+        }
+    ws->waitingPriorities.set(priority);
+    }
+
+void Controller::dequeueWaiter(Lock *lk, Looper *lpr)
+    {
+    LockWaiters *ws = lk->waiters;
+    const uinta priority = lpr->waitingPriority;
+    LockQHdr *hdr = ws->priorities + priority;
+    if (hdr->firstShared == lpr) hdr->firstShared = lpr->mtllPrev;
+    hdr->waiting.unlink(lpr);
+    if (hdr->waiting.first == hdr->firstShared) ws->exclusivePriorities.clear(priority);
+    if (hdr->waiting.empty()) ws->waitingPriorities.clear(priority);
+    }
+
+// Takes all the locks a task requests, or none of them. The looper may already
+// hold the granted lock, which is left alone. Otherwise the lock that couldn't
+// be taken's returned, for the looper to wait for without holding any others.
+bool Controller::attemptLocksHM(Looper *lpr, Task *t, Lock *granted, Lock **blocker, uinta *mode)
+    {
+    const LockRequest *requests = t->mtllLocks->requests;
+    for (uinta i = 0; i < t->mtllLocks->count; i++)
+        {
+        const LockRequest *r = requests + i;
+        if (r->lk == granted || attemptLockHM(lpr, r->lk, r->mode)) continue;
+        while (i--) if (requests[i].lk != granted) untakeLock(lpr, requests[i].lk);
+        *blocker = r->lk;
+        *mode = r->mode;
+        return NO;
+        }
+    return YES;
+    }
+
+// A looper that's been granted a lock is made ready, unless its first task
+// wants other locks too and can't have them all, in which case it gives the
+// granted lock back and waits for one it couldn't have. Returns YES if it's
+// been made ready.
+bool Controller::grantRest(Looper *lpr, Lock *lk)
+    {
+    Task *t = lpr->tasks.front();
+    Lock *blocker;
+    uinta mode;
+    if (!t->mtllLocks || !t->mtllLocks->count || attemptLocksHM(lpr, t, lk, &blocker, &mode))
+        {
+        assert(parentsHeld(lpr, t));
+        makeReady(lpr);
+        return YES;
+        }
+    untakeLock(lpr, lk);
+    waitForLock(lpr, blocker, mode);
+    return NO;
+    }
+
+bool Controller::pushTask(Looper *lpr, Task *t)
+    {
+    t->mtllRefused = NO;
+    lpr->tasks.push(t);
+    return !(atomicFetchIncrement(&lpr->pending) & ~LOOPER_DELETE_BIT);
+    }
+
+// Returns YES if the task's made the looper ready, so a worker should be woken.
+// Another thread's task may have been pushed first, so it's the looper's first
+// task whose lock is requested.
+bool Controller::submitTask(Looper *lpr, Task *t)
+    {
+    if (!pushTask(lpr, t)) return NO;
+    if (!lpr->tasks.front()->mtllLock)
+        {
+        makeReady(lpr);
+        return YES;
+        }
+    takeMutex();
+    const bool ready = waitForLockOrMakeReady(lpr);
+    releaseMutex();
+    return ready;
+    }
+
+void Controller::enqueue(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards)
+    {
+    t->mtllPrio = priority;
+    t->mtllDeleteAfterwards = deleteAfterwards;
+    t->mtllLock = 0;
+    if (submitTask(lpr, t)) wakeWorkers();
+    }
+
+void Controller::enqueue(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive)
+    {
+    enqueue(lpr, t, priority, deleteAfterwards, lk, exclusive ? MODE_X : MODE_S);
+    }
+
+void Controller::enqueue(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, LockMode mode)
+    {
+    t->mtllPrio = priority;
+    t->mtllDeleteAfterwards = deleteAfterwards;
+    t->mtllLock = lk;
+    t->mtllMode = mode;
+    if (submitTask(lpr, t)) wakeWorkers();
+    }
+
+// The requests are copied into the task's TaskLocks, so the caller's array can
+// go as soon as this returns, and sorted into address order there, which is the
+// order they're taken in.
+void Controller::enqueue(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, const LockRequest *locks, uinta lockCount)
+    {
+    t->mtllPrio = priority;
+    t->mtllDeleteAfterwards = deleteAfterwards;
+    if (lockCount < 2)
+        {
+        t->mtllLock = lockCount ? locks[0].lk : 0;
+        t->mtllMode = lockCount ? locks[0].mode : MODE_S;
+        if (t->mtllLocks) t->mtllLocks->count = 0;
+        if (submitTask(lpr, t)) wakeWorkers();
+        return;
+        }
+    if (!t->mtllLocks) t->mtllLocks = newSide<TaskLocks>();
+    TaskLocks *tl = t->mtllLocks;
+    if (lockCount > tl->capacity)
+        {
+        if (tl->requests != tl->few) delete[] tl->requests;
+        tl->requests = new LockRequest[lockCount];
+        tl->capacity = lockCount;
+        }
+    LockRequest *requests = tl->requests;
+    for (uinta i = 0; i < lockCount; i++)
+        {
+        const LockRequest r = locks[i];
+        uinta j = i;
+        for ( ; j && (uinta)requests[j - 1].lk > (uinta)r.lk; j--) requests[j] = requests[j - 1];
+        requests[j] = r;
+        assert(requests[j].lk != (j ? requests[j - 1].lk : 0));
+        }
+    tl->count = lockCount;
+    t->mtllLock = requests[0].lk;
+    t->mtllMode = requests[0].mode;
+    if (submitTask(lpr, t)) wakeWorkers();
+    }
+
+void Controller::enqueueAfter(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, uint64 micros)
+    {
+    armTimer(lpr, t, priority, deleteAfterwards, 0, NO, monotonicMicros() + micros, 0);
+    }
+
+void Controller::enqueueAfter(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive, uint64 micros)
+    {
+    armTimer(lpr, t, priority, deleteAfterwards, lk, exclusive, monotonicMicros() + micros, 0);
+    }
+
+void Controller::enqueueAt(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, uint64 when)
+    {
+    armTimer(lpr, t, priority, deleteAfterwards, 0, NO, when, 0);
+    }
+
+void Controller::enqueueAt(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive, uint64 when)
+    {
+    armTimer(lpr, t, priority, deleteAfterwards, lk, exclusive, when, 0);
+    }
+
+void Controller::enqueueEvery(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, uint64 micros)
+    {
+    assert(micros);
+    armTimer(lpr, t, priority, deleteAfterwards, 0, NO, monotonicMicros() + micros, micros);
+    }
+
+void Controller::enqueueEvery(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive, uint64 micros)
+    {
+    assert(micros);
+    armTimer(lpr, t, priority, deleteAfterwards, lk, exclusive, monotonicMicros() + micros, micros);
+    }
+
+uint64 Controller::now()
+    {
+    return monotonicMicros();
+    }
+
+// Deadlines are rounded up to a whole tick, so a timer never fires early. If
+// the new timer's due before any other the timekeeper's woken to shorten its
+// sleep, or if there isn't one a parked worker's nudged to become it.
+void Controller::armTimer(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive, uint64 when, uint64 period)
+    {
+    if (!t->mtllTimer) t->mtllTimer = newSide<TaskTimer>();
+    TaskTimer *timer = t->mtllTimer;
+    assert(timer->state == TIMER_IDLE);
+    t->mtllPrio = priority;
+    t->mtllDeleteAfterwards = deleteAfterwards;
+    t->mtllLock = lk;
+    t->mtllMode = exclusive ? MODE_X : MODE_S;
+    t->mtllTarget = lpr;
+    timer->period = period;
+    const uint64 tick = (when + timerTickMicros - 1)/timerTickMicros;
+    assert(!pthread_mutex_lock(&timerMutex));
+    timer->deadline = tick > timers->now ? tick : timers->now + 1;
+    timer->state = TIMER_ARMED;
+    timers->insert(t);
+    const uint64 oldDue = __atomic_load_n(&timerDue, __ATOMIC_RELAXED);
+    updateTimerDue();
+    const bool sooner = __atomic_load_n(&timerDue, __ATOMIC_RELAXED) < oldDue;
+    assert(!pthread_mutex_unlock(&timerMutex));
+    if (sooner) rouseTimekeeper();
+    }
+
+// A periodic timer's next deadline is the first whole period after the last
+// that's still in the future, so a late timer doesn't fire repeatedly to catch
+// up. If it's been cancelled meanwhile it's deleted instead, if required.
+void Controller::rearmTimer(Task *t)
+    {
+    bool cancelled;
+    TaskTimer *timer = t->mtllTimer;
+    assert(!pthread_mutex_lock(&timerMutex));
+    cancelled = timer->state == TIMER_CANCELLED;
+    if (cancelled)
+        {
+        timer->state = TIMER_IDLE;
+        timer->period = 0;
+        }
+    else
+        {
+        const uint64 periodTicks = (timer->period + timerTickMicros - 1)/timerTickMicros;
+        timer->deadline += periodTicks;
+        if (timer->deadline <= timers->now) timer->deadline += (timers->now - timer->deadline)/periodTicks*periodTicks + periodTicks;
+        timer->state = TIMER_ARMED;
+        timers->insert(t);
+        updateTimerDue();
+        }
+    assert(!pthread_mutex_unlock(&timerMutex));
+    if (cancelled && t->mtllDeleteAfterwards) deleteTask(t);
+    }
+
+// Called with timerMutex held.
+void Controller::updateTimerDue()
+    {
+    const uint64 tick = timers->count ? timers->nextTick() : TIMER_NEVER;
+    __atomic_store_n(&timerDue, tick == TIMER_NEVER ? TIMER_NEVER : tick*timerTickMicros, __ATOMIC_SEQ_CST);
+    }
+
+// Only 1 worker at a time advances the wheel, any other finding timers due just
+// carries on. The expired tasks are enqueued after timerMutex's released.
+void Controller::runTimers()
+    {
+    if (pthread_mutex_trylock(&timerMutex)) return;
+    DList<Task> expired;
+    timers->advance(monotonicMicros()/timerTickMicros, &expired);
+    for (Task *t = expired.first; t; t = t->mtllPrev) t->mtllTimer->state = t->mtllTimer->period ? TIMER_FIRED : TIMER_IDLE;
+    updateTimerDue();
+    assert(!pthread_mutex_unlock(&timerMutex));
+    uinta readyCount = 0;
+    Task *t;
+    while ((t = expired.unlinkFirst())) if (submitTask(t->mtllTarget, t)) readyCount++;
+    wakeWorkers(readyCount);
+    }
+
+// Returns YES if the task was waiting for its time, and now won't be enqueued.
+// A periodic timer's task that's already been enqueued isn't rearmed after it's
+// run, and if it's to be deleted afterwards it's deleted then.
+bool Controller::cancel(Task *t)
+    {
+    assert(!pthread_mutex_lock(&timerMutex));
+    TaskTimer *timer = t->mtllTimer;
+    const uint8 state = timer ? timer->state : TIMER_IDLE;
+    if (state == TIMER_ARMED)
+        {
+        timers->remove(t);
+        timer->state = TIMER_IDLE;
+        timer->period = 0;
+        updateTimerDue();
+        }
+    else if (state == TIMER_FIRED)
+        timer->state = TIMER_CANCELLED;
+    assert(!pthread_mutex_unlock(&timerMutex));
+    if (state != TIMER_ARMED) return NO;
+    if (t->mtllDeleteAfterwards) deleteTask(t);
+    return YES;
+    }
+
+// The loopers this batch makes ready are collected in a local list, those that
+// need a lock go through the mutex together, then they're all put on the ready
+// queues together and exactly as many parked workers are woken.
+void Controller::enqueueBatch(BatchEntry *entries, uinta count)
+    {
+    DList<Looper> ready;
+    DList<Looper> locking;
+    uinta readyCount = 0;
+    for (uinta i = 0; i < count; i++)
+        {
+        BatchEntry *e = entries + i;
+        Task *t = e->t;
+        t->mtllPrio = e->priority;
+        t->mtllDeleteAfterwards = e->deleteAfterwards;
+        t->mtllLock = e->lk;
+        t->mtllMode = e->exclusive ? MODE_X : MODE_S;
+        if (pushTask(e->lpr, t))
+            {
+            if (e->lpr->tasks.front()->mtllLock)
+                locking.linkLast(e->lpr);
+            else
+                {
+                ready.linkLast(e->lpr);
+                readyCount++;
+                }
+            }
+        }
+    if (!locking.empty())
+        {
+        Looper *lpr;
+        takeMutex();
+        while ((lpr = locking.unlinkFirst()))
+            if (acquireLockOrWait(lpr))
+                {
+                ready.linkLast(lpr);
+                readyCount++;
+                }
+        releaseMutex();
+        }
+    if (readyCount)
+        {
+        makeReady(&ready, readyCount);
+        wakeWorkers(readyCount);
+        }
+    }
+
+bool Controller::watch(int fd, uint32 events, Looper *lpr, Task *t, uinta priority, bool deleteAfterwards)
+    {
+    return watch(fd, events, lpr, t, priority, deleteAfterwards, 0, NO);
+    }
+
+// Watches are edge triggered. The timekeeper's roused so that it starts polling
+// if it isn't already.
+bool Controller::watch(int fd, uint32 events, Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive)
+    {
+    if (!t->mtllIo) t->mtllIo = newSide<TaskIo>();
+    assert(!t->mtllIo->watch);
+    t->mtllPrio = priority;
+    t->mtllDeleteAfterwards = deleteAfterwards;
+    t->mtllLock = lk;
+    t->mtllMode = exclusive ? MODE_X : MODE_S;
+    IoWatch *watch = new IoWatch();
+    watch->task = t;
+    watch->lpr = lpr;
+    watch->ring = 0;
+    watch->fd = fd;
+    watch->state = 0;
+    t->mtllIo->watch = watch;
+    t->mtllIo->events = 0;
+    struct epoll_event ev;
+    ev.events = (events & IO_EVENTS) | EPOLLET;
+    ev.data.ptr = watch;
+    openEpoll();
+    atomicIncrement(&ioWatchCount);
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev))
+        {
+        atomicDecrement(&ioWatchCount);
+        t->mtllIo->watch = 0;
+        delete watch;
+        return NO;
+        }
+    rouseTimekeeper();
+    return YES;
+    }
+
+// If the task's queued or running it runs once more, and the watch is finished
+// with afterwards.
+void Controller::unwatch(Task *t)
+    {
+    IoWatch *watch = t->mtllIo ? t->mtllIo->watch : 0;
+    assert(watch);
+    atomicIncrement(&ioMutexWaiters);
+    if (pthread_mutex_trylock(&ioMutex))
+        {
+        interruptPoll();
+        assert(!pthread_mutex_lock(&ioMutex));
+        }
+    atomicDecrement(&ioMutexWaiters);
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, watch->fd, 0);
+    const uint32 old = __atomic_fetch_or(&watch->state, IO_DEAD, __ATOMIC_SEQ_CST);
+    atomicDecrement(&ioWatchCount);
+    assert(!pthread_mutex_unlock(&ioMutex));
+    if (!(old & IO_QUEUED)) finishWatch(watch);
+    }
+
+// After a watching task's run it's queued again if more events have arrived,
+// otherwise it's no longer queued. The looper's pending count still includes
+// the task that's just run, so queueing another on it doesn't make it ready.
+void Controller::ioTaskDone(IoWatch *watch)
+    {
+    uint32 state = __atomic_load_n(&watch->state, __ATOMIC_SEQ_CST);
+    for ( ; ; )
+        {
+        if (state & IO_DEAD)
+            {
+            finishWatch(watch);
+            return;
+            }
+        if (state & IO_EVENTS)
+            {
+            if (submitTask(watch->lpr, watch->task)) wakeWorkers();
+            return;
+            }
+        if (__atomic_compare_exchange_n(&watch->state, &state, 0, NO, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return;
+        }
+    }
+
+void Controller::finishWatch(IoWatch *watch)
+    {
+    Task *t = watch->task;
+    t->mtllIo->watch = 0;
+    delete watch;
+    if (t->mtllDeleteAfterwards) deleteTask(t);
+    }
+
+// Must be called before any operations are submitted, so that every ring can be
+// set up with the buffers. Without io_uring they're just ordinary memory.
+bool Controller::registerBuffers(const struct iovec *iovs, uinta count)
+    {
+    assert(!pthread_mutex_lock(&ringMutex));
+    const bool registering = !atomicLoad(&ioStarted) && !ioBufferCount;
+    if (registering)
+        {
+        ioBuffers = new struct iovec[count];
+        memcpy(ioBuffers, iovs, count*sizeof(struct iovec));
+        ioBufferCount = count;
+        }
+    assert(!pthread_mutex_unlock(&ringMutex));
+    return registering;
+    }
+
+void Controller::submitRead(int fd, void *buf, uinta len, uint64 offset, const BatchEntry *completion)
+    {
+    submitIo(IORING_OP_READ, fd, buf, len, offset, 0, completion);
+    }
+
+void Controller::submitWrite(int fd, const void *buf, uinta len, uint64 offset, const BatchEntry *completion)
+    {
+    submitIo(IORING_OP_WRITE, fd, (void*)buf, len, offset, 0, completion);
+    }
 
+void Controller::submitReadFixed(int fd, void *buf, uinta len, uint64 offset, uinta bufIndex, const BatchEntry *completion)
+    {
+    assert(bufIndex < ioBufferCount);
+    submitIo(IORING_OP_READ_FIXED, fd, buf, len, offset, bufIndex, completion);
+    }
 
+void Controller::submitWriteFixed(int fd, const void *buf, uinta len, uint64 offset, uinta bufIndex, const BatchEntry *completion)
+    {
+    assert(bufIndex < ioBufferCount);
+    submitIo(IORING_OP_WRITE_FIXED, fd, (void*)buf, len, offset, bufIndex, completion);
+    }
 
-///////////////////////////////////////////////////////////////////////////////
+void Controller::submitAccept(int fd, const BatchEntry *completion)
+    {
+    submitIo(IORING_OP_ACCEPT, fd, 0, 0, 0, 0, completion);
+    }
 
+// A pool thread's operations are submitted when it next looks for a looper to
+// run, a task can call this to submit them sooner.
+void Controller::flushIo()
+    {
+    Worker *w = currentWorker;
+    if (w && w->controller == this && w->ring) flushRing(w->ring);
+    }
 
+// The completion task's fields are set up as for enqueue(), and it's submitted
+// on its looper with the result when the operation completes. Pool threads use
+// their own ring, other threads the shared one, and if io_uring's unavailable
+// the operation's handed to the offload threads instead.
+void Controller::submitIo(uint8 op, int fd, void *buf, uinta len, uint64 offset, uinta bufIndex, const BatchEntry *completion)
+    {
+    Task *t = completion->t;
+    t->mtllPrio = completion->priority;
+    t->mtllDeleteAfterwards = completion->deleteAfterwards;
+    t->mtllLock = completion->lk;
+    t->mtllMode = completion->exclusive ? MODE_X : MODE_S;
+    t->mtllTarget = completion->lpr;
+    if (!t->mtllIo) t->mtllIo = newSide<TaskIo>();
+    t->mtllIo->result = 0;
+    if (!atomicLoad(&ioStarted)) atomicStore(&ioStarted, YES);
+    Worker *w = currentWorker;
+    if (w && w->controller == this)
+        {
+        if (!w->ring && atomicLoad(&ioUring)) w->ring = newRing();
+        if (w->ring)
+            {
+            queueIo(w->ring, op, fd, buf, len, offset, bufIndex, t);
+            return;
+            }
+        }
+    else if (atomicLoad(&ioUring))
+        {
+        assert(!pthread_mutex_lock(&ringMutex));
+        if (!foreignRing && atomicLoad(&ioUring)) foreignRing = newRing();
+        if (foreignRing)
+            {
+            queueIo(foreignRing, op, fd, buf, len, offset, bufIndex, t);
+            flushRing(foreignRing);
+            }
+        assert(!pthread_mutex_unlock(&ringMutex));
+        if (foreignRing) return;
+        }
+    IoJob *job = new IoJob();
+    job->t = t;
+    job->buf = buf;
+    job->len = len;
+    job->offset = offset;
+    job->fd = fd;
+    job->op = op;
+    offloadIo(job);
+    }
 
-Looper::Looper()
+// A ring's eventfd is watched for as long as the Controller exists. If a ring
+// can't be set up io_uring's not used again.
+IoRing *Controller::newRing()
     {
-    mtllNext = mtllPrev = 0;
-    runningTaskPriority = 0;
-    markedForDelete = taskRunning = NO;
-    tasks.init();
+    IoRing *ring = new IoRing();
+    if (!ring->init(ioRingEntries, ioBuffers, ioBufferCount))
+        {
+        delete ring;
+        atomicStore(&ioUring, NO);
+        return 0;
+        }
+    ring->watch.task = 0;
+    ring->watch.lpr = 0;
+    ring->watch.ring = ring;
+    ring->watch.fd = ring->eventFd;
+    ring->watch.state = 0;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &ring->watch;
+    openEpoll();
+    const int added = epoll_ctl(epollFd, EPOLL_CTL_ADD, ring->eventFd, &ev);
+    assert(!added);
+    (void)added;
+    return ring;
     }
 
-Looper::~Looper()
+// Operations in flight count as watches, so that the timekeeper polls for their
+// completions.
+void Controller::queueIo(IoRing *ring, uint8 op, int fd, void *buf, uinta len, uint64 offset, uinta bufIndex, Task *t)
     {
-    assert(!taskRunning);
-    assert(tasks.empty());
-    assert(!locksHeld.size());
+    struct io_uring_sqe *sqe;
+    while (!(sqe = ring->nextSqe()))
+        {
+        flushRing(ring);
+        if (ring->unsubmitted) sched_yield();
+        }
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uinta)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = bufIndex;
+    if (op == IORING_OP_ACCEPT) sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uinta)t;
+    const uint32 tail = *ring->sqTail;
+    ring->sqArray[tail & ring->sqMask] = tail & ring->sqMask;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+    if (!atomicFetchIncrement(&ioWatchCount)) rouseTimekeeper();
     }
 
+// Only the ring's own worker (or for the shared ring the holder of ringMutex)
+// flushes it. If the kernel's short of resources completions are reaped until
+// it can take the rest.
+void Controller::flushRing(IoRing *ring)
+    {
+    while (ring->unsubmitted)
+        {
+        const int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, 0, 0, 0, 0);
+        if (submitted > 0)
+            ring->unsubmitted -= submitted;
+        else if (!submitted || errno == EAGAIN || errno == EBUSY)
+            {
+            wakeWorkers(reapRing(ring));
+            sched_yield();
+            }
+        else
+            assert(errno == EINTR);
+        }
+    }
 
+// Whoever gets cqMutex reaps all the completions. The check after releasing it
+// catches completions that arrived while another reaper held it, since that
+// reaper may have missed them and the eventfd may already have been read.
+uinta Controller::reapRing(IoRing *ring)
+    {
+    uinta readyCount = 0;
+    while (ring->completions() && !pthread_mutex_trylock(&ring->cqMutex))
+        {
+        uint32 head = *ring->cqHead;
+        const uint32 tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for ( ; head != tail; head++)
+            {
+            struct io_uring_cqe *cqe = ring->cqes + (head & ring->cqMask);
+            Task *t = (Task*)(uinta)cqe->user_data;
+            t->mtllIo->result = cqe->res;
+            __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+            atomicDecrement(&ioWatchCount);
+            if (submitTask(t->mtllTarget, t)) readyCount++;
+            }
+        assert(!pthread_mutex_unlock(&ring->cqMutex));
+        }
+    return readyCount;
+    }
 
-Task::Task()
+// Continuations added after the future's completed are enqueued at once.
+void Controller::addContinuation(FutureBase *f, Task *t)
     {
-    mtllNext = mtllPrev = 0;
-    mtllPrio = 0;
-    mtllLock = 0;
-    mtllExclusive = NO;
-    mtllDeleteAfterwards = NO;
+    Task *head = __atomic_load_n(&f->mtllContinuations, __ATOMIC_ACQUIRE);
+    while (head != FUTURE_COMPLETED)
+        {
+        t->mtllNext = head;
+        if (__atomic_compare_exchange_n(&f->mtllContinuations, &head, t, NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return;
+        }
+    if (!t->mtllTarget)
+        armFired((JoinArm*)t);
+    else if (submitTask(t->mtllTarget, t))
+        wakeWorkers();
     }
 
+// The continuations are enqueued in the order they were added, and exactly as
+// many workers are woken as loopers they've made ready.
+void Controller::completeFuture(FutureBase *f)
+    {
+    Task *t = __atomic_exchange_n(&f->mtllContinuations, FUTURE_COMPLETED, __ATOMIC_ACQ_REL);
+    Task *first = 0;
+    while (t)
+        {
+        Task *next = t->mtllNext;
+        t->mtllNext = first;
+        first = t;
+        t = next;
+        }
+    uinta readyCount = 0;
+    while ((t = first))
+        {
+        first = t->mtllNext;
+        if (!t->mtllTarget)
+            armFired((JoinArm*)t);
+        else if (submitTask(t->mtllTarget, t))
+            readyCount++;
+        }
+    wakeWorkers(readyCount);
+    }
 
+// A whenAny() join completes with the index of the first input that's ready, a
+// whenAll() join with the number of inputs once they're all ready.
+void Controller::armFired(JoinArm *arm)
+    {
+    FutureJoin *join = arm->join;
+    const uinta fired = atomicFetchIncrement(&join->fired);
+    if (join->any ? !fired : fired + 1 == join->count)
+        {
+        join->mtllValue = join->any ? arm->index : join->count;
+        completeFuture(join);
+        }
+    join->release();
+    }
 
-Lock::Lock(Controller *c)
+Future<uinta> Controller::whenAll(const AnyFuture *futures, uinta count)
     {
-    priorities = new LockQHdr[c->maxPriority + 1];
-    for (uinta i = 0; i <= c->maxPriority; i++) priorities[i].init();
-    holderCount = 0;
-    exclusive = markedForDelete = NO;
+    return join(futures, count, NO);
     }
 
-Lock::~Lock()
+Future<uinta> Controller::whenAny(const AnyFuture *futures, uinta count)
     {
-    assert(!holderCount);
-    delete[] priorities;
+    return join(futures, count, YES);
     }
 
+Future<uinta> Controller::join(const AnyFuture *futures, uinta count, bool any)
+    {
+    assert(count);
+    FutureJoin *join = new FutureJoin();
+    join->mtllController = this;
+    join->mtllRefs = count;
+    join->arms = new JoinArm[count];
+    join->count = count;
+    join->fired = 0;
+    join->any = any;
+    Future<uinta> f(join);
+    for (uinta i = 0; i < count; i++)
+        {
+        JoinArm *arm = join->arms + i;
+        arm->join = join;
+        arm->index = i;
+        arm->mtllTarget = 0;
+        addContinuation(futures[i].state, arm);
+        }
+    return f;
+    }
 
+// The offload threads are started when the first operation's offloaded.
+void Controller::offloadIo(IoJob *job)
+    {
+    job->next = 0;
+    assert(!pthread_mutex_lock(&offloadMutex));
+    if (offloadLast)
+        offloadLast->next = job;
+    else
+        offloadFirst = job;
+    offloadLast = job;
+    const bool starting = !offloadRunning;
+    offloadRunning = YES;
+    assert(!pthread_cond_signal(&offloadCond));
+    assert(!pthread_mutex_unlock(&offloadMutex));
+    if (!starting) return;
+    for (uinta i = 0; i < offloadThreads; i++)
+        {
+        pthread_t thd;
+        pthread_attr_t attr;
+        assert(!pthread_attr_init(&attr));
+        assert(!pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+        assert(!pthread_create(&thd, &attr, mtllStartOffloadThread, this));
+        pthread_attr_destroy(&attr);
+        }
+    }
 
-///////////////////////////////////////////////////////////////////////////////
+void Controller::runOffloadThread()
+    {
+    for ( ; ; )
+        {
+        assert(!pthread_mutex_lock(&offloadMutex));
+        while (!offloadFirst) assert(!pthread_cond_wait(&offloadCond, &offloadMutex));
+        IoJob *job = offloadFirst;
+        offloadFirst = job->next;
+        if (!offloadFirst) offloadLast = 0;
+        assert(!pthread_mutex_unlock(&offloadMutex));
+        Task *t = job->t;
+        t->mtllIo->result = performIo(job->op, job->fd, job->buf, job->len, job->offset);
+        delete job;
+        if (submitTask(t->mtllTarget, t)) wakeWorkers();
+        }
+    }
 
+void Controller::enqueueAndStopTheWorld(Task *t, bool deleteAfterwards)
+    {
+    t->mtllPrio = maxPriority;
+    t->mtllDeleteAfterwards = deleteAfterwards;
+    t->mtllLock = 0;
+    takeMutex();
+    specialLooper->tasks.push(t);
+    atomicStore(&stopTheWorld, YES);
+    if (!specialLooper->taskRunning && !anyWorkerRunning()) wakeWorkers();
+    releaseMutex();
+    }
 
+void Controller::enqueueAndStopTheGroup(LooperGroup *g, Task *t, bool deleteAfterwards)
+    {
+    t->mtllPrio = maxPriority;
+    t->mtllDeleteAfterwards = deleteAfterwards;
+    t->mtllLock = 0;
+    takeMutex();
+    g->stopTasks.linkLast(t);
+    atomicStore(&g->stopping, YES);
+    const bool schedule = !g->stopScheduled && atomicLoad(&g->refs) < GROUP_RUNNING;
+    if (schedule) scheduleGroupStop(g);
+    releaseMutex();
+    if (schedule) wakeWorkers();
+    }
 
-extern "C" void *mtllStartThread(void *context)
+void Controller::enqueueAfterQuiescence(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards)
     {
-    ((Controller*)context)->runPoolThread();
-    return 0;
+    enqueueAfterQuiescence(lpr, t, priority, deleteAfterwards, 0, NO);
     }
 
-Controller::Controller(uinta threadCount, uinta maxPriority)
+// Tasks queued while a grace period's in progress wait for the next one, which
+// starts as soon as the current one's over and covers all of them.
+void Controller::enqueueAfterQuiescence(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive)
     {
-    this->maxPriority = maxPriority;
-    priorities = new DList<Looper>[maxPriority + 1];
-    for (uinta i = 0; i <= maxPriority; i++) priorities[i].init();
-    runningThreadCount = 0;
-    waitingThreadCount = 0;
-    readyLooperCount = 0;
-    specialLooper = new Looper();
-    mutex = PTHREAD_MUTEX_INITIALIZER;
-    cond = PTHREAD_COND_INITIALIZER;
-    startThreadPool(threadCount);
+    t->mtllTarget = lpr;
+    t->mtllPrio = priority;
+    t->mtllDeleteAfterwards = deleteAfterwards;
+    t->mtllLock = lk;
+    t->mtllMode = exclusive ? MODE_X : MODE_S;
+    assert(!pthread_mutex_lock(&graceMutex));
+    t->mtllNext = graceNext;
+    graceNext = t;
+    if (!graceTasks) startGracePeriod();
+    assert(!pthread_mutex_unlock(&graceMutex));
+    checkQuiescence();
     }
 
-Controller::~Controller()
+// Each worker's task count is bumped after every task it runs. A grace period
+// waits for the workers that were running when it started, each of them until
+// its count's changed or it's stopped running, and for no others. gracePending
+// is set before the running flags are read, and a worker reads it after
+// clearing its own flag, so one or other of them notices.
+void Controller::startGracePeriod()
     {
-    assert(false);
+    Task *t = graceNext;
+    graceNext = 0;
+    while (t)
+        {
+        Task *next = t->mtllNext;
+        t->mtllNext = graceTasks;
+        graceTasks = t;
+        t = next;
+        }
+    atomicStore(&gracePending, YES);
+    graceRemaining = 0;
+    for (uinta i = 0; i < maxThreads; i++)
+        {
+        Worker *w = workers[i];
+        w->graceSnapshot = __atomic_load_n(&w->tasksRun, __ATOMIC_SEQ_CST);
+        w->graceWaiting = atomicLoad(&w->running);
+        if (w->graceWaiting) graceRemaining++;
+        }
     }
 
-void Controller::runPoolThread()
+bool Controller::gracePeriodOver()
     {
-    takeMutex();
-    for ( ; ; )
+    for (uinta i = 0; graceRemaining && i < maxThreads; i++)
         {
-        Looper *lpr;
-        for ( ; ; )
-            {
-            lpr = fetchNextReadyLooper();
-            if (lpr) break;
-            waitingThreadCount++;
-            waitOnCondition();
-            waitingThreadCount--;
-            }
-        if (lpr != specialLooper && waitingThreadCount && readyLooperCount) signalCondition();
-        DList<Task> *tasks = &lpr->tasks;
-        Task *t = tasks->unlinkFirst();
-        if (lpr != specialLooper) runningThreadCount++;
-        lpr->taskRunning = YES;
-        lpr->runningTaskPriority = t->mtllPrio;
-        const bool deleteAfterwards = t->mtllDeleteAfterwards;
-        releaseMutex();
-        t->mtllRun(this, lpr != specialLooper ? lpr : 0);
-        if (deleteAfterwards) delete t;
-        takeMutex();
-        lpr->taskRunning = NO;
-        if (lpr != specialLooper)
+        Worker *w = workers[i];
+        if (w->graceWaiting && (!atomicLoad(&w->running) || __atomic_load_n(&w->tasksRun, __ATOMIC_SEQ_CST) != w->graceSnapshot))
             {
-            runningThreadCount--;
-            if (!lpr->tasks.empty())
-                waitForLockOrMakeReady(lpr);
-            else if (lpr->markedForDelete)
-                finalizeAndDelete(lpr);
+            w->graceWaiting = NO;
+            graceRemaining--;
             }
         }
+    return !graceRemaining;
     }
 
-Looper *Controller::fetchNextReadyLooper()
+// Whoever gets graceMutex checks for everyone. The check after releasing it
+// catches a worker that passed a quiescent state while it was held.
+void Controller::checkQuiescence()
     {
-    if (specialLooper->taskRunning) return 0;
-    if (!specialLooper->tasks.empty()) return runningThreadCount == 0 ? specialLooper : 0;
-    for (inta i = maxPriority; i >= 0; i--)
+    Task *first = 0;
+    Task **last = &first;
+    atomicStore(&graceRecheck, YES);
+    while (atomicLoad(&graceRecheck) && !pthread_mutex_trylock(&graceMutex))
         {
-        DList<Looper> *hdr = priorities + i;
-        Looper *lpr = hdr->unlinkFirst();
-        if (lpr)
+        atomicStore(&graceRecheck, NO);
+        while (graceTasks && gracePeriodOver())
             {
-            readyLooperCount--;
-            return lpr;
+            *last = graceTasks;
+            while (*last) last = &(*last)->mtllNext;
+            graceTasks = 0;
+            if (graceNext) startGracePeriod();
             }
+        if (!graceTasks) atomicStore(&gracePending, NO);
+        assert(!pthread_mutex_unlock(&graceMutex));
         }
-    return 0;
+    uinta readyCount = 0;
+    for (Task *t = first; t; )
+        {
+        Task *next = t->mtllNext;
+        if (submitTask(t->mtllTarget, t)) readyCount++;
+        t = next;
+        }
+    wakeWorkers(readyCount);
     }
 
-bool Controller::waitForLockOrMakeReady(Looper *lpr)
+bool Controller::attemptLock(Looper *lpr, Lock *lk, bool exclusive)
     {
-    Task *t = lpr->tasks.first;
-    Lock *lk = t->mtllLock;
-    if (lk && !attemptLockHM(lpr, lk, t->mtllExclusive))
+    return attemptLock(lpr, lk, exclusive ? MODE_X : MODE_S);
+    }
+
+// Without the mutex if the lock's uncontended, in which case the only other
+// changes to its state are other loopers taking and releasing it likewise. A
+// lock with intention holders is always contended.
+bool Controller::attemptLock(Looper *lpr, Lock *lk, LockMode mode)
+    {
+    uinta state = atomicLoad(&lk->state);
+    while (mode <= MODE_X && !(state & LOCK_CONTENDED))
         {
-        LockQHdr *hdr = lk->priorities + t->mtllPrio;
-        if (t->mtllExclusive)
-            hdr->waiting.linkBefore(lpr, hdr->firstShared);
-        else
+        if (mode == MODE_X ? state : state & LOCK_EXCLUSIVE) return NO;
+        if (atomicCompareExchange(&lk->state, &state, mode == MODE_X ? LOCK_EXCLUSIVE + 1 : state + 1))
             {
-            if (!hdr->firstShared) hdr->firstShared = lpr;
-            hdr->waiting.linkLast(lpr);
+            assert(!lpr->locksHeld.contains(lk));
+            lpr->locksHeld.set(lk);
+            assert(parentHeld(lpr, lk, mode));
+            return YES;
             }
-        return NO;
         }
-    makeReady(lpr);
-    return YES;
+    takeMutex();
+    const bool result = attemptLockHM(lpr, lk, mode);
+    assert(!result || parentHeld(lpr, lk, mode));
+    releaseMutex();
+    return result;
     }
 
-void Controller::enqueue(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards)
+// A looper's let in if the lock's free, or if it's compatible with the modes the
+// lock's held in and it wouldn't get ahead of any waiter at its priority or above
+// that it's incompatible with. That's the exclusive waiters for shared and IS
+// requests, and any waiter for the others. Other than under the writer preferring
+// policy it's waiters at any priority, and under FIFO any waiter at all.
+bool Controller::attemptLockHM(Looper *lpr, Lock *lk, uinta mode)
     {
-    t->mtllPrio = priority;
-    t->mtllDeleteAfterwards = deleteAfterwards;
-    t->mtllLock = 0;
-    takeMutex();
-    lpr->tasks.linkLast(t);
-    if (!lpr->taskRunning && lpr->tasks.first == t)
+    uinta state = atomicLoad(&lk->state);
+    do
         {
-        makeReady(lpr);
-        if (waitingThreadCount) signalCondition();
+        if (!(state & LOCK_HOLDERS)) continue;
+        if (heldModes(lk, state) & ~COMPATIBLE_MODES[mode]) return NO;
+        LockWaiters *ws = state & LOCK_CONTENDED ? lk->waiters : 0;
+        if (!ws) continue;
+        PriorityBitmap *ahead = modeBit(mode) & EXCLUSIVE_WAITER_MODES || lk->policy == POLICY_FIFO ? &ws->waitingPriorities : &ws->exclusivePriorities;
+        if (ws->upgrader || ahead->anyAtOrAbove(lk->policy == POLICY_WRITER_PREFERRING ? lpr->priority() : 0)) return NO;
         }
+    while (!atomicCompareExchange(&lk->state, &state, (mode > MODE_X ? state | LOCK_CONTENDED : state) + (mode == MODE_X ? LOCK_EXCLUSIVE + 1 : 1)));
+    addHolder(lpr, lk, mode);
+    return YES;
+    }
+
+// The modes the lock's held in, given its state. Its intention holders are
+// counted along with its wait queues, which it keeps while it has any, and the
+// rest hold it in shared mode unless it's held in exclusive mode.
+uinta Controller::heldModes(Lock *lk, uinta state)
+    {
+    if (state & LOCK_EXCLUSIVE) return modeBit(MODE_X);
+    LockWaiters *ws = state & LOCK_CONTENDED ? lk->waiters : 0;
+    uinta modes = 0;
+    uinta intentHolders = 0;
+    if (ws)
+        for (uinta i = 0; i < 3; i++)
+            if (ws->intentHolders[i])
+                {
+                modes |= modeBit(MODE_IS + i);
+                intentHolders += ws->intentHolders[i];
+                }
+    if ((state & LOCK_HOLDERS) > intentHolders) modes |= modeBit(MODE_S);
+    return modes;
+    }
+
+bool Controller::parentHeld(Looper *lpr, Lock *lk, uinta mode)
+    {
+    Lock *parent = lk->parent;
+    if (!parent || lpr->locksHeld.contains(parent, MODE_IX) || lpr->locksHeld.contains(parent, MODE_SIX)) return YES;
+    if (mode == MODE_S || mode == MODE_IS) return lpr->locksHeld.contains(parent) || lpr->locksHeld.contains(parent, MODE_IS);
+    return lpr->locksHeld.contains(parent) && (atomicLoad(&parent->state) & LOCK_EXCLUSIVE);
+    }
+
+// The parents of the locks a task requests may be among them.
+bool Controller::parentsHeld(Looper *lpr, Task *t)
+    {
+    if (!t->mtllLocks || !t->mtllLocks->count) return parentHeld(lpr, t->mtllLock, t->mtllMode);
+    const LockRequest *requests = t->mtllLocks->requests;
+    for (uinta i = 0; i < t->mtllLocks->count; i++)
+        if (!parentHeld(lpr, requests[i].lk, requests[i].mode)) return NO;
+    return YES;
+    }
+
+// Only for granting a contended lock, whose state nobody else is changing.
+void Controller::takeLock(Looper *lpr, Lock *lk, uinta mode)
+    {
+    atomicAdd(&lk->state, mode == MODE_X ? LOCK_EXCLUSIVE + 1 : 1);
+    addHolder(lpr, lk, mode);
+    }
+
+void Controller::addHolder(Looper *lpr, Lock *lk, uinta mode)
+    {
+    assert(!lpr->locksHeld.holds(lk));
+    if (mode > MODE_X) waitersFor(lk)->intentHolders[mode - MODE_IS]++;
+    lpr->locksHeld.set(lk, mode);
+    }
+
+// Returns the mode the looper held the lock in.
+uinta Controller::removeHolder(Looper *lpr, Lock *lk)
+    {
+    if (lpr->locksHeld.expunge(lk)) return atomicLoad(&lk->state) & LOCK_EXCLUSIVE ? MODE_X : MODE_S;
+    for (uinta mode = MODE_IS; mode <= MODE_SIX; mode++)
+        if (lpr->locksHeld.expunge(lk, mode))
+            {
+            lk->waiters->intentHolders[mode - MODE_IS]--;
+            return mode;
+            }
+    assert(false);
+    return MODE_S;
+    }
+
+// Gives back a lock that was taken with the mutex held, before any waiters
+// could have noticed, so there's no need to grant it to them. If it was taken
+// in an intention mode it may be being granted further up the stack, so it's
+// left contended for its next unlock to sort out.
+void Controller::untakeLock(Looper *lpr, Lock *lk)
+    {
+    removeHolder(lpr, lk);
+    uinta state = atomicLoad(&lk->state);
+    while (!atomicCompareExchange(&lk->state, &state, (state & ~LOCK_EXCLUSIVE) - 1));
+    }
+
+void Controller::unlock(Looper *lpr, Lock *lk)
+    {
+    uinta state = atomicLoad(&lk->state);
+    while (!(state & LOCK_CONTENDED))
+        if (atomicCompareExchange(&lk->state, &state, state & LOCK_EXCLUSIVE ? 0 : state - 1))
+            {
+            assert(lpr->locksHeld.expunge(lk));
+            return;
+            }
+    takeMutex();
+    const uinta readyCount = unlockHM(lpr, lk);
     releaseMutex();
+    wakeWorkers(readyCount);
     }
 
-void Controller::enqueue(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive)
+// The looper must hold the lock in shared mode by the time the task's first in
+// its queue, and the task runs once the lock's been upgraded to exclusive mode.
+void Controller::enqueueUpgrade(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk)
     {
     t->mtllPrio = priority;
     t->mtllDeleteAfterwards = deleteAfterwards;
     t->mtllLock = lk;
-    t->mtllExclusive = exclusive;
-    takeMutex();
-    lpr->tasks.linkLast(t);
-    if (!lpr->taskRunning && lpr->tasks.first == t && waitForLockOrMakeReady(lpr) && waitingThreadCount) signalCondition();
-    releaseMutex();
+    t->mtllMode = MODE_X;
+    t->mtllUpgrade = YES;
+    if (submitTask(lpr, t)) wakeWorkers();
     }
 
-void Controller::enqueueAndStopTheWorld(Task *t, bool deleteAfterwards)
+void Controller::downgrade(Looper *lpr, Lock *lk)
     {
-    t->mtllPrio = maxPriority;
-    t->mtllDeleteAfterwards = deleteAfterwards;
-    t->mtllLock = 0;
+    assert(lpr->locksHeld.contains(lk));
+    uinta state = LOCK_EXCLUSIVE + 1;
+    if (atomicCompareExchange(&lk->state, &state, 1)) return;
     takeMutex();
-    specialLooper->tasks.linkLast(t);
-    if (!specialLooper->taskRunning && specialLooper->tasks.first == t && !runningThreadCount) signalCondition();
+    const uinta old = atomicFetchAnd(&lk->state, ~LOCK_EXCLUSIVE);
+    assert(old & LOCK_EXCLUSIVE);
+    (void)old;
+    const uinta readyCount = admitWaitersHM(lk);
+    uncontendHM(lk);
     releaseMutex();
+    wakeWorkers(readyCount);
     }
 
-bool Controller::attemptLock(Looper *lpr, Lock *lk, bool exclusive)
+// A contended lock's upgrader gets it as soon as it's the only holder left, and
+// once it has no holders it's granted to its waiters. Otherwise any waiters that
+// are now compatible with the modes it's held in are let in.
+uinta Controller::unlockHM(Looper *lpr, Lock *lk)
     {
-    takeMutex();
-    const bool result = attemptLockHM(lpr, lk, exclusive);
-    releaseMutex();
-    return result;
+    removeHolder(lpr, lk);
+    uinta state = atomicLoad(&lk->state);
+    while (!(state & LOCK_CONTENDED))
+        if (atomicCompareExchange(&lk->state, &state, state & LOCK_EXCLUSIVE ? 0 : state - 1)) return 0;
+    state = (state & ~LOCK_EXCLUSIVE) - 1;
+    atomicStore(&lk->state, state);
+    if (!(state & LOCK_HOLDERS)) return grantWaitersHM(lk);
+    uinta readyCount = 0;
+    LockWaiters *ws = lk->waiters;
+    if ((state & LOCK_HOLDERS) == 1 && ws && ws->upgrader)
+        {
+        Looper *upgrader = ws->upgrader;
+        ws->upgrader = 0;
+        atomicFetchOr(&lk->state, LOCK_EXCLUSIVE);
+        if (trackWaiters) stoppedWaiting(upgrader);
+        makeReady(upgrader);
+        readyCount = 1;
+        }
+    else
+        readyCount = admitWaitersHM(lk);
+    uncontendHM(lk);
+    return readyCount;
     }
 
-bool Controller::attemptLockHM(Looper *lpr, Lock *lk, bool exclusive)
+// Waiters that want other locks too may give the lock back, and wait for one
+// of those instead, in which case it's granted to the next waiters. Once there
+// are none left the lock's deleted if it's marked for delete, otherwise it's no
+// longer contended.
+uinta Controller::grantWaitersHM(Lock *lk)
     {
-    if (lk->holderCount)
+    uinta readyCount = 0;
+    while (!(atomicLoad(&lk->state) & LOCK_HOLDERS))
         {
-        if (exclusive)
-            return NO;
-        else
+        LockWaiters *ws = lk->waiters;
+        if (!ws || ws->waitingPriorities.empty())
+            {
+            if (!(atomicLoad(&lk->state) & LOCK_DELETE)) break;
+            delete lk;
+            return readyCount;
+            }
+        readyCount += admitWaitersHM(lk);
+        }
+    uncontendHM(lk);
+    return readyCount;
+    }
+
+// Lets in the waiters that are compatible with the modes the lock's held in. While
+// it's held by others an exclusive waiter that has to carry on waiting holds back
+// those behind it, as attemptLockHM() would. But if it's just been released it's
+// granted to every waiter it can be, so if the highest priority waiter wants it
+// exclusively it gets it, and if it wants it in shared mode so do the shared
+// waiters behind any exclusive ones at lower priorities. A phase fair lock that's
+// been released goes to the shared waiters if its last holders were exclusive,
+// otherwise to the first exclusive waiter, and while there are exclusive waiters
+// no more shared ones are let in. A FIFO lock's waiters are let in strictly in
+// turn. Returns the number of loopers made ready.
+uinta Controller::admitWaitersHM(Lock *lk)
+    {
+    LockWaiters *ws = lk->waiters;
+    if (!ws || ws->upgrader) return 0;
+    const bool released = !(atomicLoad(&lk->state) & LOCK_HOLDERS);
+    const uinta allModes = EXCLUSIVE_WAITER_MODES | modeBit(MODE_S) | modeBit(MODE_IS);
+    uinta readyCount = 0;
+    if (lk->policy == POLICY_FIFO) return admitHM(lk, allModes, allModes);
+    if (lk->policy == POLICY_PHASE_FAIR)
+        {
+        if (released && ws->exclusivePhase)
+            readyCount = admitHM(lk, allModes & ~EXCLUSIVE_WAITER_MODES, 0);
+        else if (!ws->exclusivePriorities.empty())
+            {
+            readyCount = admitHM(lk, EXCLUSIVE_WAITER_MODES, EXCLUSIVE_WAITER_MODES);
+            if (!released) return readyCount;
+            }
+        }
+    readyCount += admitHM(lk, allModes, released ? 0 : EXCLUSIVE_WAITER_MODES);
+    if (released) ws->exclusivePhase = (heldModes(lk, atomicLoad(&lk->state)) & EXCLUSIVE_WAITER_MODES) != 0;
+    return readyCount;
+    }
+
+// Walks the wait queues highest priority first and then in queue order, letting
+// in the waiters in the given modes that are compatible with the modes the lock's
+// held in. An incompatible waiter in one of the stop modes ends the walk, others
+// are passed over.
+uinta Controller::admitHM(Lock *lk, uinta modes, uinta stopModes)
+    {
+    LockWaiters *ws = lk->waiters;
+    uinta readyCount = 0;
+    for (inta i = ws->waitingPriorities.highest(); i >= 0; i = ws->waitingPriorities.highestBelow(i))
+        {
+        LockQHdr *hdr = ws->priorities + i;
+        Looper *lpr = modes & EXCLUSIVE_WAITER_MODES ? hdr->waiting.first : hdr->firstShared;
+        while (lpr && (modeBit(lpr->waitingMode) & modes))
             {
-            if (lk->exclusive) return NO;
-            inta priority = lpr->priority();
-            for (inta i = maxPriority; i >= priority; i--)
+            const uinta held = heldModes(lk, atomicLoad(&lk->state));
+            const uinta mode = lpr->waitingMode;
+            if (held & modeBit(MODE_X)) return readyCount;
+            if (held & ~COMPATIBLE_MODES[mode])
+                {
+                if (modeBit(mode) & stopModes) return readyCount;
+                // If an IX waiter couldn't be let in no exclusive waiter could.
+                lpr = modeBit(mode) & EXCLUSIVE_WAITER_MODES && held & ~COMPATIBLE_MODES[MODE_IX] ? hdr->firstShared : lpr->mtllPrev;
+                continue;
+                }
+            Looper *next = lpr->mtllPrev;
+            dequeueWaiter(lk, lpr);
+            if (trackWaiters) stoppedWaiting(lpr);
+            takeLock(lpr, lk, mode);
+            // Giving the lock back to wait for another one can find and break a
+            // deadlock, refusing a looper in this queue, so then it starts again.
+            if (grantRest(lpr, lk))
                 {
-                Looper *firstLooper = lk->priorities[i].waiting.first;
-                if (firstLooper && firstLooper->tasks.first->mtllExclusive) return NO;
+                readyCount++;
+                lpr = next;
                 }
+            else
+                lpr = modes & EXCLUSIVE_WAITER_MODES ? hdr->waiting.first : hdr->firstShared;
             }
         }
-    takeLock(lpr, lk, exclusive);
-    return YES;
+    return readyCount;
     }
 
-void Controller::takeLock(Looper *lpr, Lock *lk, bool exclusive)
+// A looper's handed back to the worker that last ran it, via the worker's
+// runnext slot, if that's the worker making it ready or if it's parked. But not
+// if it's busy running another looper, because then the looper would wait
+// while other workers might be idle. In fair share mode it always goes on a ready
+// queue, to take its turn.
+void Controller::makeReady(Looper *lpr)
     {
-    assert(!lpr->locksHeld.contains(lk));
-    lk->exclusive = exclusive;
-    lk->holderCount++;
-    lpr->locksHeld.set(lk);
+    Worker *last = lpr->lastWorker;
+    if (last && !fairShare)
+        {
+        const inta home = relaxedLoad(&lpr->homeNode);
+        if ((home < 0 || (uinta)home == last->node->index) && (last == currentWorker ? !last->blocking : __atomic_load_n(&last->parked, __ATOMIC_RELAXED)) && atomicClaim(&last->runNext, lpr)) return;
+        }
+    pushReady(lpr);
     }
 
-void Controller::unlock(Looper *lpr, Lock *lk)
+void Controller::pushReady(Looper *lpr)
     {
-    takeMutex();
-    if (unlockHM(lpr, lk) && waitingThreadCount) signalCondition();
-    releaseMutex();
+    ReadyQueue *q = readyQueueFor(lpr);
+    q->takeMutex();
+    q->push(lpr, lpr->tasks.front()->mtllPrio);
+    q->releaseMutex();
     }
 
-bool Controller::unlockHM(Looper *lpr, Lock *lk)
+// Pool threads put the whole list on their own queue, other threads split it
+// evenly over all the queues. Either way each queue's mutex is taken once.
+// Loopers with a home node are made ready one at a time on their home node.
+void Controller::makeReady(DList<Looper> *lprs, uinta count)
     {
-    assert(lpr->locksHeld.expunge(lk));
-    if (--lk->holderCount) return NO;
-    bool lockGranted = NO;
-    for (inta i = maxPriority; i >= 0; i--)
-        {
-        LockQHdr *hdr = lk->priorities + i;
-        if (lockGranted)
+    DList<Looper> anywhere;
+    uinta anywhereCount = 0;
+    Looper *lpr;
+    while ((lpr = lprs->unlinkFirst()))
+        if (relaxedLoad(&lpr->homeNode) >= 0)
+            makeReady(lpr);
+        else
             {
-            Looper *lpr = hdr->firstShared;
-            while (lpr)
-                {
-                Looper *prevLpr = lpr->mtllPrev;
-                hdr->waiting.unlink(lpr);
-                takeLock(lpr, lk, false);
-                makeReady(lpr);
-                lpr = prevLpr;
-                }
-            hdr->firstShared = 0;
+            anywhere.linkLast(lpr);
+            anywhereCount++;
             }
-        else
+    Worker *w = currentWorker;
+    const uinta share = (w && w->controller == this) || queueCount == 1 ? anywhereCount : (anywhereCount + queueCount - 1)/queueCount;
+    while (!anywhere.empty())
+        {
+        ReadyQueue *q = readyQueueFor(anywhere.first);
+        q->takeMutex();
+        for (uinta i = 0; i < share && !anywhere.empty(); i++)
             {
-            Looper *lpr = hdr->waiting.first;
-            if (lpr)
-                {
-                if (lpr->tasks.first->mtllExclusive)
-                    {
-                    hdr->waiting.unlink(lpr);
-                    takeLock(lpr, lk, true);
-                    makeReady(lpr);
-                    return YES;
-                    }
-                lockGranted = YES;
-                while (lpr)
-                    {
-                    Looper *prevLpr = lpr->mtllPrev;
-                    hdr->waiting.unlink(lpr);
-                    takeLock(lpr, lk, false);
-                    makeReady(lpr);
-                    lpr = prevLpr;
-                    }
-                hdr->firstShared = 0;
-                }
+            lpr = anywhere.unlinkFirst();
+            q->push(lpr, lpr->tasks.front()->mtllPrio);
             }
+        q->releaseMutex();
         }
-    if (!lockGranted && lk->markedForDelete) delete lk;
-    return lockGranted;
     }
 
-void Controller::makeReady(Looper *lpr)
+void Controller::setQuantum(Looper *lpr, uinta tasks, uinta micros)
+    {
+    relaxedStore(&lpr->quantumTasks, tasks);
+    relaxedStore(&lpr->quantumMicros, micros);
+    }
+
+void Controller::setWeight(Looper *lpr, uinta weight)
+    {
+    assert(weight);
+    relaxedStore(&lpr->weight, weight);
+    }
+
+uint64 Controller::runNanos(Looper *lpr)
+    {
+    return __atomic_load_n(&lpr->runNanos, __ATOMIC_RELAXED);
+    }
+
+void Controller::affinityCounts(uinta *resumed, uinta *hits)
+    {
+    *resumed = *hits = 0;
+    for (uinta i = 0; i < maxThreads; i++)
+        {
+        *resumed += relaxedLoad(&workers[i]->resumed);
+        *hits += relaxedLoad(&workers[i]->affinityHits);
+        }
+    }
+
+void Controller::setHomeNode(Looper *lpr, uinta node)
     {
-    priorities[lpr->tasks.first->mtllPrio].linkLast(lpr);
-    readyLooperCount++;
+    assert(node < numaNodeCount);
+    relaxedStore(&lpr->homeNode, node);
     }
 
 void Controller::safeDelete(Looper *lpr)
     {
+    LooperGroup *g = lpr->group;
+    if (atomicFetchOr(&lpr->pending, LOOPER_DELETE_BIT)) return;
+    takeMutex();
+    const uinta readyCount = finalizeAndDelete(lpr);
+    releaseMutex();
+    wakeWorkers(readyCount);
+    if (g) releaseGroup(g, 1);
+    }
+
+// Idle loopers are deleted at once, in a single pass with the mutex held, busy
+// ones by their owners when they run out of tasks. The group's deleted with its
+// last looper (or when its stop tasks finish, if that's later).
+void Controller::safeDelete(LooperGroup *g)
+    {
+    uinta readyCount = 0;
+    uinta deleted = 0;
     takeMutex();
-    if (!lpr->taskRunning && lpr->tasks.empty())
+    for (Looper *lpr = g->members, *next; lpr; lpr = next)
         {
-        if (finalizeAndDelete(lpr) && waitingThreadCount) signalCondition();
+        next = lpr->groupNext;
+        if (atomicFetchOr(&lpr->pending, LOOPER_DELETE_BIT)) continue;
+        readyCount += finalizeAndDelete(lpr);
+        deleted++;
         }
-    else
-        lpr->markedForDelete = YES;
     releaseMutex();
+    wakeWorkers(readyCount);
+    releaseGroup(g, deleted + 1);
     }
 
-bool Controller::finalizeAndDelete(Looper *lpr)
+uinta Controller::finalizeAndDelete(Looper *lpr)
     {
-    bool lockGranted = NO;
-    LockSetIterator *it = new LockSetIterator(&lpr->locksHeld);
+    uinta readyCount = 0;
+    LockSetIterator it;
     Lock *lk;
-    while (it->next(&lk)) if (unlockHM(lpr, lk)) lockGranted = YES;
+    // unlockHM() removes the lock from the set, so start again from the beginning each time.
+    for (it.init(&lpr->locksHeld); it.next(&lk); it.init(&lpr->locksHeld)) readyCount += unlockHM(lpr, lk);
+    LooperGroup *g = lpr->group;
+    if (g)
+        {
+        if (lpr->groupNext) lpr->groupNext->groupPrev = lpr->groupPrev;
+        if (lpr->groupPrev)
+            lpr->groupPrev->groupNext = lpr->groupNext;
+        else
+            g->members = lpr->groupNext;
+        }
     delete lpr;
-    return lockGranted;
+    return readyCount;
     }
 
 void Controller::safeDelete(Lock *lk)
     {
     takeMutex();
-    if (!lk->holderCount)
-        delete lk;
-    else
-        lk->markedForDelete = YES;
+    if (!(atomicFetchOr(&lk->state, LOCK_CONTENDED | LOCK_DELETE) & LOCK_HOLDERS)) delete lk;
     releaseMutex();
     }
 
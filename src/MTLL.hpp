@@ -24,6 +24,14 @@
 
 #include <bits/pthreadtypes.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <new>
+
+#if __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define MTLL_COROUTINES (1)
+#endif
 
 #include "basic_types.h"
 #include "UintXTrieSet.hpp"
@@ -35,15 +43,54 @@ namespace MTLL { // MultiThreaded Locking Looper
 
 
 template<class Item> class DList;
+template<class Item> class MPSCQueue;
+class PriorityBitmap;
+class Options;
+class BatchEntry;
+class LockRequest;
+class DeadlockHandler;
 class Controller;
 class Task;
 class Looper;
+class LooperGroup;
 class LockQHdr;
+class LockWaiters;
 class Lock;
 class LockSet;
 class LockSetIterator;
+class ReadyQueue;
+class FairHeap;
+class Worker;
+class NumaNode;
+class NodePool;
+class TimerWheel;
+class IoWatch;
+class IoRing;
+class IoJob;
+class TaskTimer;
+class TaskIo;
+class TaskLocks;
+class FutureBase;
+template<class T> class FutureValue;
+template<class T> class FutureTask;
+template<class T, class F> class ClosureFutureTask;
+class AnyFuture;
+template<class T> class Future;
+class FutureJoin;
+class JoinArm;
+template<class F> class ClosureTask;
+#ifdef MTLL_COROUTINES
+class CoTask;
+class FinalAwaiter;
+template<class T> class CoroutinePromise;
+template<class T> class Coroutine;
+class LockAwaiter;
+class SleepAwaiter;
+template<class T> class CallAwaiter;
+#endif
 
 extern "C" void *mtllStartThread(void *context);
+extern "C" void *mtllStartOffloadThread(void *context);
 
 
 
@@ -58,6 +105,9 @@ private:
     friend class Controller;
     friend class Looper;
     friend class LockQHdr;
+    friend class ReadyQueue;
+    friend class TimerWheel;
+    friend class LooperGroup;
 
     Item *first;
     Item *last;
@@ -137,6 +187,278 @@ private:
 
 
 
+// Intrusive multiple producer single consumer queue, linked from first to last
+// through the items' mtllNext. Any thread may push at any time, but only the
+// consumer may pop, and only the consumer's view of the first item is stable.
+template<class Item>
+class MPSCQueue
+    {
+private:
+    friend class Controller;
+    friend class Looper;
+
+    Item *head;
+    Item *tail;
+
+    MPSCQueue()
+        {
+        head = tail = 0;
+        }
+
+    void init()
+        {
+        head = tail = 0;
+        }
+
+    Item *first()
+        {
+        return __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        }
+
+    // The first item, when the queue's known not to be empty. If the first item
+    // was pushed while another push (which swapped the tail earlier) was still
+    // storing the head, the head may not be visible yet, so wait for it.
+    Item *front()
+        {
+        Item *it;
+        while (!(it = __atomic_load_n(&head, __ATOMIC_ACQUIRE))) sched_yield();
+        return it;
+        }
+
+    void push(Item *it)
+        {
+        it->mtllNext = 0;
+        Item *prev = __atomic_exchange_n(&tail, it, __ATOMIC_ACQ_REL);
+        if (prev)
+            __atomic_store_n(&prev->mtllNext, it, __ATOMIC_RELEASE);
+        else
+            __atomic_store_n(&head, it, __ATOMIC_RELEASE);
+        }
+
+    Item *pop()
+        {
+        Item *it = head;
+        Item *next = __atomic_load_n(&it->mtllNext, __ATOMIC_ACQUIRE);
+        if (!next)
+            {
+            __atomic_store_n(&head, (Item*)0, __ATOMIC_RELAXED);
+            Item *expected = it;
+            if (__atomic_compare_exchange_n(&tail, &expected, (Item*)0, NO, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return it;
+            // A push has swapped the tail but not linked its item yet.
+            while (!(next = __atomic_load_n(&it->mtllNext, __ATOMIC_ACQUIRE))) sched_yield();
+            }
+        __atomic_store_n(&head, next, __ATOMIC_RELEASE);
+        return it;
+        }
+    };
+
+
+
+// The set of priorities in use. Up to 8*sizeof(uinta) priorities fit in the
+// summary word alone, beyond that each bit of the summary says whether the
+// corresponding word of the array has any bits set. Either way finding the
+// highest priority in use takes at most 2 count leading zeros.
+class PriorityBitmap
+    {
+private:
+    friend class Controller;
+    friend class ReadyQueue;
+    friend class Lock;
+
+    static const uinta BITS = 8*sizeof(uinta);
+
+    uinta summary;
+    uinta *words;
+
+    PriorityBitmap()
+        {
+        summary = 0;
+        words = 0;
+        }
+
+    ~PriorityBitmap()
+        {
+        delete[] words;
+        }
+
+    void init(uinta maxPriority)
+        {
+        assert(maxPriority < BITS*BITS);
+        summary = 0;
+        words = maxPriority < BITS ? 0 : new uinta[maxPriority/BITS + 1]();
+        }
+
+    static uinta bit(uinta i)
+        {
+        return ((uinta)1) << i;
+        }
+
+    static uinta highestBit(uinta x)
+        {
+        return 8*sizeof(unsigned long long) - 1 - __builtin_clzll((unsigned long long)x);
+        }
+
+    bool empty()
+        {
+        return !summary;
+        }
+
+    void set(uinta priority)
+        {
+        if (!words)
+            summary |= bit(priority);
+        else
+            {
+            words[priority/BITS] |= bit(priority%BITS);
+            summary |= bit(priority/BITS);
+            }
+        }
+
+    void clear(uinta priority)
+        {
+        if (!words)
+            summary &= ~bit(priority);
+        else if (!(words[priority/BITS] &= ~bit(priority%BITS)))
+            summary &= ~bit(priority/BITS);
+        }
+
+    inta highest()
+        {
+        if (!summary) return -1;
+        if (!words) return highestBit(summary);
+        const uinta w = highestBit(summary);
+        return w*BITS + highestBit(words[w]);
+        }
+
+    inta highestBelow(uinta priority)
+        {
+        if (!words)
+            {
+            const uinta below = summary & (bit(priority) - 1);
+            return below ? (inta)highestBit(below) : -1;
+            }
+        uinta w = priority/BITS;
+        const uinta below = words[w] & (bit(priority%BITS) - 1);
+        if (below) return w*BITS + highestBit(below);
+        const uinta wordsBelow = summary & (bit(w) - 1);
+        if (!wordsBelow) return -1;
+        w = highestBit(wordsBelow);
+        return w*BITS + highestBit(words[w]);
+        }
+
+    bool anyAtOrAbove(uinta priority)
+        {
+        return highest() >= (inta)priority;
+        }
+    };
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
+class Options
+    {
+public:
+    Options();
+
+    bool workStealing;
+    bool fairShare;
+    uinta quantumTasks;
+    uinta quantumMicros;
+    uinta spinMicros;
+    uinta maxThreads;
+    bool autoScale;
+    uinta idleRetireMicros;
+    uinta timerTickMicros;
+    uinta ioPollMicros;
+    bool ioUring;
+    uinta ioRingEntries;
+    uinta ioOffloadThreads;
+    const cpu_set_t *cpuSets;
+    uinta cpuSetCount;
+    bool numaAware;
+    DeadlockHandler *deadlockHandler;
+    uinta deadlockScanMicros;
+    uinta lockAgingMicros;
+    };
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
+// The modes a lock can be held in. Besides shared and exclusive, the intention
+// modes let a looper lock a child of the lock (see Lock's parent) in shared mode
+// (IS), in either mode (IX), or hold the whole lock shared while locking its
+// children exclusively (SIX). Two loopers can hold the lock at once if:
+//          S    X    IS   IX   SIX
+//    S     yes  no   yes  no   no
+//    X     no   no   no   no   no
+//    IS    yes  no   yes  yes  yes
+//    IX    no   no   yes  yes  no
+//    SIX   no   no   yes  no   no
+enum LockMode
+    {
+    MODE_S,
+    MODE_X,
+    MODE_IS,
+    MODE_IX,
+    MODE_SIX
+    };
+
+// How a contended lock's shared and exclusive waiters share it. Writer preferring
+// lets shared requests in while there are no exclusive waiters at their priority
+// or above. Phase fair alternates between all the shared waiters and the next
+// exclusive one. FIFO grants it in the order it's requested, ignoring priority.
+enum LockPolicy
+    {
+    POLICY_WRITER_PREFERRING,
+    POLICY_PHASE_FAIR,
+    POLICY_FIFO
+    };
+
+class LockRequest
+    {
+public:
+    LockRequest();
+    LockRequest(Lock *lk, bool exclusive);
+    LockRequest(Lock *lk, LockMode mode);
+
+    Lock *lk;
+    LockMode mode;
+    };
+
+// Told about each cycle of loopers waiting for each other's locks. loopers[i]
+// waits for locks[i], which loopers[(i + 1)%count] holds. Returns the index of
+// the looper whose lock request's to be refused, or -1 to leave them waiting.
+// It's called with the Controller's mutex held, so mustn't call the Controller.
+class DeadlockHandler
+    {
+public:
+    virtual ~DeadlockHandler() { }
+    virtual inta mtllDeadlock(Controller *c, Looper *const *loopers, Lock *const *locks, uinta count) = 0;
+    };
+
+class BatchEntry
+    {
+public:
+    BatchEntry();
+    BatchEntry(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards);
+    BatchEntry(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive);
+
+    Looper *lpr;
+    Task *t;
+    uinta priority;
+    bool deleteAfterwards;
+    Lock *lk;
+    bool exclusive;
+    };
+
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 
@@ -145,41 +467,249 @@ class Controller
     {
 public:
     Controller(uinta threadCount, uinta maxPriority);
+    Controller(uinta threadCount, uinta maxPriority, const Options *opts);
     virtual ~Controller();
     void enqueue(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards);
     void enqueue(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive);
+    void enqueue(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, LockMode mode);
+    void enqueue(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, const LockRequest *locks, uinta lockCount);
+    template<class F> void enqueue(Looper *lpr, F f, uinta priority);
+    void enqueueBatch(BatchEntry *entries, uinta count);
+    void enqueueAfter(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, uint64 micros);
+    void enqueueAfter(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive, uint64 micros);
+    void enqueueAt(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, uint64 when);
+    void enqueueAt(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive, uint64 when);
+    void enqueueEvery(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, uint64 micros);
+    void enqueueEvery(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive, uint64 micros);
+    bool cancel(Task *t);
+    uint64 now();
+    bool watch(int fd, uint32 events, Looper *lpr, Task *t, uinta priority, bool deleteAfterwards);
+    bool watch(int fd, uint32 events, Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive);
+    void unwatch(Task *t);
+    bool registerBuffers(const struct iovec *iovs, uinta count);
+    void submitRead(int fd, void *buf, uinta len, uint64 offset, const BatchEntry *completion);
+    void submitWrite(int fd, const void *buf, uinta len, uint64 offset, const BatchEntry *completion);
+    void submitReadFixed(int fd, void *buf, uinta len, uint64 offset, uinta bufIndex, const BatchEntry *completion);
+    void submitWriteFixed(int fd, const void *buf, uinta len, uint64 offset, uinta bufIndex, const BatchEntry *completion);
+    void submitAccept(int fd, const BatchEntry *completion);
+    void flushIo();
     void enqueueAndStopTheWorld(Task *t, bool deleteAfterwards);
+    void enqueueAfterQuiescence(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards);
+    void enqueueAfterQuiescence(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive);
+    void enqueueAndStopTheGroup(LooperGroup *g, Task *t, bool deleteAfterwards);
     bool attemptLock(Looper *lpr, Lock *lk, bool exclusive);
+    bool attemptLock(Looper *lpr, Lock *lk, LockMode mode);
     void unlock(Looper *lpr, Lock *lk);
+    void enqueueUpgrade(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk);
+    void downgrade(Looper *lpr, Lock *lk);
+    void setQuantum(Looper *lpr, uinta tasks, uinta micros);
+    void setWeight(Looper *lpr, uinta weight);
+    uint64 runNanos(Looper *lpr);
+    void setHomeNode(Looper *lpr, uinta node);
+    void affinityCounts(uinta *resumed, uinta *hits);
+    void beginBlocking();
+    void endBlocking();
+    uinta nodeCount() { return numaNodeCount; }
     void safeDelete(Looper *lpr);
     void safeDelete(Lock *lk);
+    void safeDelete(LooperGroup *g);
+    template<class T> Future<T> enqueueFuture(Looper *lpr, FutureTask<T> *t, uinta priority);
+    template<class T> Future<T> enqueueFuture(Looper *lpr, FutureTask<T> *t, uinta priority, Lock *lk, bool exclusive);
+    template<class T, class... Args> T *newTask(Args&&... args);
+    void deleteTask(Task *t);
+    Future<uinta> whenAll(const AnyFuture *futures, uinta count);
+    Future<uinta> whenAny(const AnyFuture *futures, uinta count);
+#ifdef MTLL_COROUTINES
+    LockAwaiter lock(Lock *lk, bool exclusive);
+    LockAwaiter lock(Lock *lk, LockMode mode);
+    SleepAwaiter sleepFor(uint64 micros);
+    template<class T> CallAwaiter<T> call(Looper *lpr, Coroutine<T> &&co);
+#endif
 
 private:
     friend class Lock;
+    friend class Looper;
+    friend class AnyFuture;
+    template<class T> friend class FutureTask;
 
     uinta waitingThreadCount;
-    uinta runningThreadCount;
-    uinta readyLooperCount;
+    bool stopTheWorld;
     Looper *specialLooper;
-    DList<Looper> *priorities;
+    LooperGroup *stoppedGroups;
+    uinta stoppedGroupCount;
+    ReadyQueue **queues;
+    uinta queueCount;
+    Worker **workers;
+    uinta minThreads;
+    uinta maxThreads;
+    uinta liveThreads;
+    uinta blockingThreads;
+    bool autoScale;
+    bool spawning;
+    uinta idleRetireMicros;
+    cpu_set_t *pins;
+    TimerWheel *timers;
+    uint64 timerTickMicros;
+    uint64 timerDue;
+    Worker *timekeeper;
+    pthread_mutex_t timerMutex;
+    int epollFd;
+    int wakeFd;
+    uinta ioWatchCount;
+    uinta ioMutexWaiters;
+    uint64 ioPollDue;
+    uint64 ioPollMicros;
+    pthread_mutex_t ioMutex;
+    IoRing *foreignRing;
+    struct iovec *ioBuffers;
+    uinta ioBufferCount;
+    uinta ioRingEntries;
+    bool ioUring;
+    bool ioStarted;
+    pthread_mutex_t ringMutex;
+    IoJob *offloadFirst;
+    IoJob *offloadLast;
+    uinta offloadThreads;
+    bool offloadRunning;
+    pthread_mutex_t offloadMutex;
+    pthread_cond_t offloadCond;
+    Task *graceTasks;
+    Task *graceNext;
+    uinta graceRemaining;
+    bool gracePending;
+    bool graceRecheck;
+    pthread_mutex_t graceMutex;
+    NumaNode *nodes;
+    uinta numaNodeCount;
+    uint16 *cpuNodes;
+    bool numaAware;
+    bool fairShare;
     uinta maxPriority;
+    uinta quantumTasks;
+    uinta quantumMicros;
+    uinta spinMicros;
+    Worker *parkedWorkers;
+    DeadlockHandler *deadlockHandler;
+    uinta deadlockScanMicros;
+    uinta lockAgingMicros;
+    bool trackWaiters;
+    Looper *waitingLoopers;
+    Looper *lastWaitingLooper;
+    uint64 waiterCheckDue;
+    uint64 deadlockScanDue;
+    uinta deadlockMark;
+    Looper **deadlockStack;
+    Looper **deadlockLoopers;
+    Lock **deadlockLocks;
+    uinta deadlockCapacity;
     pthread_mutex_t mutex;
-    pthread_cond_t cond;
-
-    void runPoolThread();
-    Looper *fetchNextReadyLooper();
+    pthread_mutex_t parkMutex;
+
+    void init(uinta threadCount, uinta maxPriority, const Options *opts);
+    void initNodes(const Options *opts);
+    void *allocInternal(uinta size, NumaNode *node);
+    void *allocTask();
+    void freeTask(void *block);
+    template<class S> S *newSide();
+    void freeSides(Task *t);
+    NumaNode *callerNode();
+    void runPoolThread(Worker *w);
+    Looper *fetchNextReadyLooper(Worker *w);
+    Looper *popReadyLooper(Worker *w);
+    void runLooperTask(Worker *w, Looper *lpr);
+    bool higherPriorityReady(Worker *w, uinta priority);
+    bool runStopTheWorld();
+    bool enterGroup(Looper *lpr);
+    void leaveGroup(LooperGroup *g);
+    void scheduleGroupStop(LooperGroup *g);
+    void runStoppedGroup(Worker *w);
+    void addMember(LooperGroup *g, Looper *lpr);
+    void releaseGroup(LooperGroup *g, uinta count);
+    bool anyWorkerRunning();
+    bool workVisible();
+    bool park(Worker *w);
+    bool spinForWork(Worker *w);
+    bool unparkSelf(Worker *w);
+    bool retire(Worker *w);
+    bool keepTime(Worker *w);
+    void stopKeepingTime(Worker *w, bool nudge);
+    uint64 nextDue();
+    void nudgeParked();
+    void rouse(Worker *w);
+    void openEpoll();
+    bool pollIo(Worker *sleeper, uint64 until);
+    void interruptPoll();
+    void ioTaskDone(IoWatch *watch);
+    void finishWatch(IoWatch *watch);
+    void rouseTimekeeper();
+    void submitIo(uint8 op, int fd, void *buf, uinta len, uint64 offset, uinta bufIndex, const BatchEntry *completion);
+    IoRing *newRing();
+    void queueIo(IoRing *ring, uint8 op, int fd, void *buf, uinta len, uint64 offset, uinta bufIndex, Task *t);
+    void flushRing(IoRing *ring);
+    uinta reapRing(IoRing *ring);
+    void addContinuation(FutureBase *f, Task *t);
+    void completeFuture(FutureBase *f);
+    void armFired(JoinArm *arm);
+    Future<uinta> join(const AnyFuture *futures, uinta count, bool any);
+    void offloadIo(IoJob *job);
+    void runOffloadThread();
+    void startGracePeriod();
+    bool gracePeriodOver();
+    void checkQuiescence();
+    friend void *mtllStartOffloadThread(void *context);
+    void runTimers();
+    void armTimer(Looper *lpr, Task *t, uinta priority, bool deleteAfterwards, Lock *lk, bool exclusive, uint64 when, uint64 period);
+    void rearmTimer(Task *t);
+    void updateTimerDue();
+    void wakeWorkers()                      { wakeWorkers(1);                                                                               }
+    void wakeWorkers(uinta n);
+    void wakeAllWorkers();
+    ReadyQueue *readyQueueFor(Looper *lpr);
+    bool pushTask(Looper *lpr, Task *t);
+    bool submitTask(Looper *lpr, Task *t);
     bool waitForLockOrMakeReady(Looper *lpr);
-    bool attemptLockHM(Looper *lpr, Lock *lk, bool exclusive);
-    void takeLock(Looper *lpr, Lock *lk, bool exclusive);
-    bool unlockHM(Looper *lpr, Lock *lk);
+    bool acquireLockOrWait(Looper *lpr);
+    void waitForLock(Looper *lpr, Lock *lk, uinta mode);
+    bool attemptUpgradeHM(Looper *lpr, Task *t);
+    void startedWaiting(Looper *lpr, Lock *lk);
+    void stoppedWaiting(Looper *lpr);
+    Looper *nextWaiter(Lock *lk, Looper *waiter);
+    bool findDeadlock(Looper *root, bool lowestOnly);
+    void growDeadlockBuffers(uinta size);
+    void scanForDeadlocksHM();
+    void checkWaiters(uint64 now);
+    uinta ageWaitersHM(uint64 now);
+    void updateWaiterCheckDue();
+    void refuseLock(Looper *lpr);
+    void queueWaiter(Lock *lk, Looper *lpr);
+    void dequeueWaiter(Lock *lk, Looper *lpr);
+    bool attemptLocksHM(Looper *lpr, Task *t, Lock *granted, Lock **blocker, uinta *mode);
+    bool grantRest(Looper *lpr, Lock *lk);
+    uinta admitWaitersHM(Lock *lk);
+    uinta admitHM(Lock *lk, uinta modes, uinta stopModes);
+    uinta heldModes(Lock *lk, uinta state);
+    bool parentHeld(Looper *lpr, Lock *lk, uinta mode);
+    bool parentsHeld(Looper *lpr, Task *t);
+    bool attemptLockHM(Looper *lpr, Lock *lk, uinta mode);
+    void takeLock(Looper *lpr, Lock *lk, uinta mode);
+    void addHolder(Looper *lpr, Lock *lk, uinta mode);
+    uinta removeHolder(Looper *lpr, Lock *lk);
+    void untakeLock(Looper *lpr, Lock *lk);
+    uinta unlockHM(Looper *lpr, Lock *lk);
+    uinta grantWaitersHM(Lock *lk);
+    LockWaiters *waitersFor(Lock *lk);
+    void uncontendHM(Lock *lk);
     void makeReady(Looper *lpr);
-    bool finalizeAndDelete(Looper *lpr);
+    void pushReady(Looper *lpr);
+    void makeReady(DList<Looper> *lprs, uinta count);
+    uinta finalizeAndDelete(Looper *lpr);
     friend void *mtllStartThread(void *context);
-    void startThreadPool(uinta threadCount) { pthread_t thd; while (threadCount--) assert(!pthread_create(&thd, 0, mtllStartThread, this)); }
+    void startThread(Worker *w);
+    void addWorker();
     void takeMutex()                        { assert(!pthread_mutex_lock(&mutex));                                                          }
     void releaseMutex()                     { assert(!pthread_mutex_unlock(&mutex));                                                        }
-    void waitOnCondition()                  { assert(!pthread_cond_wait(&cond, &mutex));                                                    }
-    void signalCondition()                  { assert(!pthread_cond_signal(&cond));                                                          }
+    void takeParkMutex()                    { assert(!pthread_mutex_lock(&parkMutex));                                                      }
+    void releaseParkMutex()                 { assert(!pthread_mutex_unlock(&parkMutex));                                                    }
     };
 
 
@@ -192,21 +722,37 @@ class Task
     {
 public:
     Task();
-    virtual ~Task() { }
+    virtual ~Task();
     uinta mtllPriority() { return mtllPrio; }
+    uint32 mtllEvents();
+    inta mtllResult();
+    bool mtllLockRefused() { return mtllRefused; }
     virtual void mtllRun(Controller *c, Looper *lpr) = 0;
 
 private:
+    friend class MPSCQueue<Task>;
     friend class DList<Task>;
     friend class Controller;
     friend class Looper;
+    friend class TimerWheel;
+    friend class AnyFuture;
+#ifdef MTLL_COROUTINES
+    friend class CoTask;
+#endif
 
     Task *mtllNext;
     Task *mtllPrev;
     uinta mtllPrio;
     Lock *mtllLock;
-    bool mtllExclusive;
+    Looper *mtllTarget;
+    TaskTimer *mtllTimer;
+    TaskIo *mtllIo;
+    TaskLocks *mtllLocks;
+    uint8 mtllMode;
     bool mtllDeleteAfterwards;
+    bool mtllRefused;
+    bool mtllUpgrade;
+    bool mtllPooled;
     };
 
 
@@ -215,10 +761,16 @@ private:
 
 
 
+// A lock with a parent, e.g. a row's lock whose parent is its table's lock, may
+// only be taken by a looper holding the parent in IS, IX or a stronger mode for
+// shared access and in IX, SIX or X mode for exclusive or intention exclusive
+// access.
 class Lock
     {
 public:
     Lock(Controller *c);
+    Lock(Controller *c, Lock *parent);
+    Lock(Controller *c, Lock *parent, LockPolicy policy);
 
 protected:
     virtual ~Lock();
@@ -226,23 +778,30 @@ protected:
 private:
     friend class Controller;
 
-    LockQHdr *priorities;
-    uinta holderCount;
-    bool exclusive;
-    bool markedForDelete;
+    LockWaiters *waiters;
+    Lock *parent;
+    uinta state;
+    uint8 policy;
     };
 
+// A lock held in an intention mode is kept with that mode in its key's low bits.
 class LockSet : private UintaTrieSet
     {
 private:
     friend class Controller;
     friend class Looper;
 
-    bool set(const Lock *lk)      { return UintaTrieSet::set((uinta)lk);      }
-    bool expunge(const Lock *lk)  { return UintaTrieSet::expunge((uinta)lk);  }
-    bool contains(const Lock *lk) { return UintaTrieSet::contains((uinta)lk); }
-    void clear()                  {        UintaTrieSet::clear();             }
-    uinta size()                  { return UintaTrieSet::size();              }
+    static uinta key(const Lock *lk, uinta mode) { return (uinta)lk | (mode > MODE_X ? mode - MODE_X : 0); }
+
+    bool set(const Lock *lk)                  { return UintaTrieSet::set((uinta)lk);                       }
+    bool expunge(const Lock *lk)              { return UintaTrieSet::expunge((uinta)lk);                   }
+    bool contains(const Lock *lk)             { return UintaTrieSet::contains((uinta)lk);                  }
+    bool set(const Lock *lk, uinta mode)      { return UintaTrieSet::set(key(lk, mode));                   }
+    bool expunge(const Lock *lk, uinta mode)  { return UintaTrieSet::expunge(key(lk, mode));               }
+    bool contains(const Lock *lk, uinta mode) { return UintaTrieSet::contains(key(lk, mode));              }
+    bool holds(const Lock *lk)                { return contains(lk) || contains(lk, MODE_IS) || contains(lk, MODE_IX) || contains(lk, MODE_SIX); }
+    void clear()                              {        UintaTrieSet::clear();                              }
+    uinta size()                              { return UintaTrieSet::size();                               }
     };
 
 
@@ -255,23 +814,71 @@ class Looper
     {
 public:
     Looper();
+    Looper(LooperGroup *group);
 
 protected:
     virtual ~Looper();
 
 private:
     friend class DList<Looper>;
+    friend class FairHeap;
     friend class Controller;
 
     Looper *mtllNext;
     Looper *mtllPrev;
-    DList<Task> tasks;
+    LooperGroup *group;
+    Looper *groupNext;
+    Looper *groupPrev;
+    Lock *waitingFor;
+    Looper *waitNext;
+    Looper *waitPrev;
+    uint64 waitingSince;
+    uinta waitingPriority;
+    Looper *deadlockParent;
+    uinta deadlockMark;
+    MPSCQueue<Task> tasks;
+    uinta pending;
     LockSet locksHeld;
     uinta runningTaskPriority;
+    inta homeNode;
+    Worker *lastWorker;
+    uinta quantumTasks;
+    uinta quantumMicros;
+    uinta weight;
+    uint64 vruntime;
+    uint64 runNanos;
     bool taskRunning;
-    bool markedForDelete;
+    uint8 waitingMode;
+
+    void init(LooperGroup *group);
+    uinta priority();
+    };
+
+// A set of loopers that can be stopped, or deleted, together. Its references
+// are its creator's, 1 for each looper, 1 while it's stopped, and 1 for each
+// looper that a worker's running, in which case the count's high half is also
+// incremented. So the group outlives every run of its loopers.
+class LooperGroup
+    {
+public:
+    LooperGroup(Controller *c);
+
+protected:
+    virtual ~LooperGroup();
+
+private:
+    friend class Controller;
+    friend class Looper;
 
-    uinta priority() { return taskRunning ? runningTaskPriority : (tasks.first ? tasks.first->mtllPrio : 0); }
+    Controller *controller;
+    LooperGroup *nextStopped;
+    Looper *members;
+    DList<Looper> halted;
+    uinta haltedCount;
+    DList<Task> stopTasks;
+    uinta refs;
+    bool stopping;
+    bool stopScheduled;
     };
 
 
@@ -280,5 +887,465 @@ private:
 
 
 
+// The size of the blocks pooled Tasks are allocated in. A Task subclass that
+// doesn't fit is allocated on the heap instead.
+static const uinta TASK_BLOCK_SIZE = 256;
+
+// Runs a closure, enqueued by enqueue(lpr, f, priority).
+template<class F>
+class ClosureTask : public Task
+    {
+public:
+    ClosureTask(F &&f) : mtllClosure(static_cast<F&&>(f)) { }
+    void mtllRun(Controller *c, Looper *lpr) { mtllClosure(); }
+
+private:
+    F mtllClosure;
+    };
+
+template<class T, class... Args>
+T *Controller::newTask(Args&&... args)
+    {
+    if (sizeof(T) > TASK_BLOCK_SIZE) return new T(static_cast<Args&&>(args)...);
+    T *t = new (allocTask()) T(static_cast<Args&&>(args)...);
+    t->mtllPooled = YES;
+    return t;
+    }
+
+template<class F>
+void Controller::enqueue(Looper *lpr, F f, uinta priority)
+    {
+    enqueue(lpr, newTask<ClosureTask<F>>(static_cast<F&&>(f)), priority, YES);
+    }
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
+#ifdef MTLL_COROUTINES
+
+// A coroutine's promise is the Task that's enqueued whenever it's to run, so it
+// must be enqueued with deleteAfterwards false, the coroutine frees itself when
+// it returns. While it waits for a lock or a timer the same Task is enqueued
+// again on the same looper (so other tasks on the looper may run in between).
+// A coroutine called from another coroutine enqueues its caller again when it
+// returns, and the caller frees it after fetching its result.
+class CoTask : public Task
+    {
+public:
+    void mtllRun(Controller *c, Looper *lpr);
+    std::suspend_always initial_suspend() { return std::suspend_always(); }
+    FinalAwaiter final_suspend() noexcept;
+    void unhandled_exception() { assert(false); }
+
+private:
+    friend class LockAwaiter;
+    friend class SleepAwaiter;
+    template<class T> friend class CoroutinePromise;
+    template<class T> friend class CallAwaiter;
+    template<class T> friend class Future;
+    friend class FinalAwaiter;
+
+    std::coroutine_handle<> mtllHandle;
+    Controller *mtllController;
+    Looper *mtllLooper;
+    CoTask *mtllCaller;
+    };
+
+class FinalAwaiter
+    {
+public:
+    FinalAwaiter(CoTask *t) { this->t = t; }
+    bool await_ready() noexcept { return NO; }
+    bool await_suspend(std::coroutine_handle<>) noexcept;
+    void await_resume() noexcept { }
+
+private:
+    CoTask *t;
+    };
+
+template<class T>
+class CoroutinePromise : public CoTask
+    {
+public:
+    Coroutine<T> get_return_object();
+    void return_value(const T &value) { this->value = value; }
+    T result() { return value; }
+
+private:
+    T value;
+    };
+
+template<>
+class CoroutinePromise<void> : public CoTask
+    {
+public:
+    Coroutine<void> get_return_object();
+    void return_void() { }
+    void result() { }
+    };
+
+// Owns a coroutine that hasn't been started yet. task() hands it over, to be
+// enqueued, or it can be passed to Controller's call().
+template<class T = void>
+class Coroutine
+    {
+public:
+    typedef CoroutinePromise<T> promise_type;
+
+    Coroutine(std::coroutine_handle<promise_type> h) { handle = h;                                }
+    Coroutine(Coroutine &&other)                    { handle = other.handle; other.handle = 0;   }
+    ~Coroutine()                                    { if (handle) handle.destroy();               }
+    Task *task()                                    { Task *t = &handle.promise(); handle = 0; return t; }
+
+private:
+    template<class U> friend class CallAwaiter;
+
+    std::coroutine_handle<promise_type> handle;
+    };
+
+// If the lock can be taken at once the coroutine carries on without suspending.
+class LockAwaiter
+    {
+public:
+    LockAwaiter(Lock *lk, LockMode mode) { this->lk = lk; this->mode = mode; }
+    bool await_ready() { return NO; }
+    template<class P> bool await_suspend(std::coroutine_handle<P> h);
+    void await_resume() { }
+
+private:
+    Lock *lk;
+    LockMode mode;
+    };
+
+class SleepAwaiter
+    {
+public:
+    SleepAwaiter(uint64 micros) { this->micros = micros; }
+    bool await_ready() { return NO; }
+    template<class P> void await_suspend(std::coroutine_handle<P> h);
+    void await_resume() { }
+
+private:
+    uint64 micros;
+    };
+
+template<class T>
+class CallAwaiter
+    {
+public:
+    CallAwaiter(Looper *lpr, Coroutine<T> &&co) : co((Coroutine<T>&&)co) { this->lpr = lpr; }
+    bool await_ready() { return NO; }
+    template<class P> void await_suspend(std::coroutine_handle<P> h);
+    T await_resume() { return co.handle.promise().result(); }
+
+private:
+    Looper *lpr;
+    Coroutine<T> co;
+    };
+
+inline void CoTask::mtllRun(Controller *c, Looper *lpr)
+    {
+    assert(!mtllDeleteAfterwards);
+    mtllController = c;
+    mtllLooper = lpr;
+    mtllHandle.resume();
+    }
+
+inline FinalAwaiter CoTask::final_suspend() noexcept
+    {
+    return FinalAwaiter(this);
+    }
+
+// Returning NO lets a coroutine nobody's waiting for run off its end, which
+// frees it. Once the caller's enqueued it may free the callee at any time.
+inline bool FinalAwaiter::await_suspend(std::coroutine_handle<>) noexcept
+    {
+    CoTask *caller = t->mtllCaller;
+    if (!caller) return NO;
+    caller->mtllController->enqueue(caller->mtllLooper, caller, caller->mtllPriority(), NO);
+    return YES;
+    }
+
+template<class T>
+Coroutine<T> CoroutinePromise<T>::get_return_object()
+    {
+    std::coroutine_handle<CoroutinePromise<T> > h = std::coroutine_handle<CoroutinePromise<T> >::from_promise(*this);
+    mtllHandle = h;
+    mtllCaller = 0;
+    return Coroutine<T>(h);
+    }
+
+inline Coroutine<void> CoroutinePromise<void>::get_return_object()
+    {
+    std::coroutine_handle<CoroutinePromise<void> > h = std::coroutine_handle<CoroutinePromise<void> >::from_promise(*this);
+    mtllHandle = h;
+    mtllCaller = 0;
+    return Coroutine<void>(h);
+    }
+
+template<class P>
+bool LockAwaiter::await_suspend(std::coroutine_handle<P> h)
+    {
+    CoTask *t = &h.promise();
+    if (t->mtllController->attemptLock(t->mtllLooper, lk, mode)) return NO;
+    t->mtllController->enqueue(t->mtllLooper, t, t->mtllPriority(), NO, lk, mode);
+    return YES;
+    }
+
+template<class P>
+void SleepAwaiter::await_suspend(std::coroutine_handle<P> h)
+    {
+    CoTask *t = &h.promise();
+    t->mtllController->enqueueAfter(t->mtllLooper, t, t->mtllPriority(), NO, micros);
+    }
+
+template<class T>
+template<class P>
+void CallAwaiter<T>::await_suspend(std::coroutine_handle<P> h)
+    {
+    CoTask *caller = &h.promise();
+    CoTask *callee = &co.handle.promise();
+    callee->mtllCaller = caller;
+    caller->mtllController->enqueue(lpr, callee, caller->mtllPriority(), NO);
+    }
+
+inline LockAwaiter Controller::lock(Lock *lk, bool exclusive)
+    {
+    return LockAwaiter(lk, exclusive ? MODE_X : MODE_S);
+    }
+
+inline LockAwaiter Controller::lock(Lock *lk, LockMode mode)
+    {
+    return LockAwaiter(lk, mode);
+    }
+
+inline SleepAwaiter Controller::sleepFor(uint64 micros)
+    {
+    return SleepAwaiter(micros);
+    }
+
+template<class T>
+CallAwaiter<T> Controller::call(Looper *lpr, Coroutine<T> &&co)
+    {
+    return CallAwaiter<T>(lpr, (Coroutine<T>&&)co);
+    }
+
+#endif // #ifdef MTLL_COROUTINES
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
+// A future's shared state, embedded in the task that produces its value. The
+// continuations are a stack of tasks linked through their mtllNext, replaced by
+// a marker once the value's ready. The state's reference counted, the producer
+// holds a reference until it's run and each Future holds one, and it's deleted
+// (along with the task it's part of) when the last one's released.
+class FutureBase
+    {
+public:
+    FutureBase()          { mtllController = 0; mtllContinuations = 0; mtllRefs = 1;                  }
+    virtual ~FutureBase() { }
+    bool ready()          { return __atomic_load_n(&mtllContinuations, __ATOMIC_ACQUIRE) == (Task*)1; }
+
+protected:
+    virtual void mtllFree() { delete this; }
+
+private:
+    friend class Controller;
+    friend class AnyFuture;
+    template<class T> friend class FutureTask;
+
+    Controller *mtllController;
+    Task *mtllContinuations;
+    uinta mtllRefs;
+
+    void acquire() { __atomic_add_fetch(&mtllRefs, 1, __ATOMIC_SEQ_CST);                     }
+    void release() { if (!__atomic_sub_fetch(&mtllRefs, 1, __ATOMIC_SEQ_CST)) mtllFree(); }
+    };
+
+template<class T>
+class FutureValue : public FutureBase
+    {
+private:
+    friend class Controller;
+    friend class Future<T>;
+    friend class FutureTask<T>;
+
+    T mtllValue;
+    };
+
+// A Future<void> has no value, it's just ready or not, e.g. for a closure
+// continuation that returns nothing.
+template<>
+class FutureValue<void> : public FutureBase
+    {
+private:
+    friend class Controller;
+    friend class Future<void>;
+    friend class FutureTask<void>;
+    };
+
+// A task whose mtllCompute() produces a Future's value. It mustn't be enqueued
+// with enqueue(), only with enqueueFuture() or as a continuation with then(),
+// and it's deleted when the value's no longer needed. It may have been made by
+// newTask(), so it's deleted by the Controller.
+template<class T>
+class FutureTask : public Task, public FutureValue<T>
+    {
+public:
+    virtual T mtllCompute(Controller *c, Looper *lpr) = 0;
+    void mtllRun(Controller *c, Looper *lpr);
+
+protected:
+    void mtllFree() { this->mtllController->deleteTask(this); }
+    };
+
+// Computes a future's value by calling a closure, attached by then(lpr, priority, f).
+template<class T, class F>
+class ClosureFutureTask : public FutureTask<T>
+    {
+public:
+    ClosureFutureTask(F &&f) : mtllClosure(static_cast<F&&>(f)) { }
+    T mtllCompute(Controller *c, Looper *lpr) { return mtllClosure(); }
+
+private:
+    F mtllClosure;
+    };
+
+// A reference to a future of any type, e.g. for whenAll() and whenAny().
+class AnyFuture
+    {
+public:
+    AnyFuture()                              { state = 0;                                                               }
+    AnyFuture(const AnyFuture &other)        { state = other.state; if (state) state->acquire();                        }
+    ~AnyFuture()                             { if (state) state->release();                                             }
+    AnyFuture &operator=(const AnyFuture &other);
+    bool ready() const                       { return state && state->ready();                                         }
+    void then(Looper *lpr, uinta priority, Task *t, bool deleteAfterwards);
+    template<class U> Future<U> then(Looper *lpr, uinta priority, FutureTask<U> *t);
+    template<class F> auto then(Looper *lpr, uinta priority, F f) -> Future<decltype(f())>;
+
+protected:
+    friend class Controller;
+
+    FutureBase *state;
+
+    AnyFuture(FutureBase *s)                 { state = s; s->acquire();                                                 }
+    };
+
+template<class T>
+class Future : public AnyFuture
+    {
+public:
+    Future() { }
+    T value() const { assert(ready()); return ((FutureValue<T>*)state)->mtllValue; }
+#ifdef MTLL_COROUTINES
+    bool await_ready() { return ready(); }
+    template<class P> void await_suspend(std::coroutine_handle<P> h);
+    T await_resume() { return value(); }
+#endif
+
+private:
+    friend class Controller;
+    friend class AnyFuture;
+
+    Future(FutureValue<T> *s) : AnyFuture(s) { }
+    };
+
+template<class T>
+void FutureTask<T>::mtllRun(Controller *c, Looper *lpr)
+    {
+    this->mtllValue = mtllCompute(c, lpr);
+    c->completeFuture(this);
+    this->release();
+    }
+
+template<>
+inline void FutureTask<void>::mtllRun(Controller *c, Looper *lpr)
+    {
+    mtllCompute(c, lpr);
+    c->completeFuture(this);
+    this->release();
+    }
+
+template<>
+inline void Future<void>::value() const
+    {
+    assert(ready());
+    }
+
+inline AnyFuture &AnyFuture::operator=(const AnyFuture &other)
+    {
+    if (other.state) other.state->acquire();
+    if (state) state->release();
+    state = other.state;
+    return *this;
+    }
+
+inline void AnyFuture::then(Looper *lpr, uinta priority, Task *t, bool deleteAfterwards)
+    {
+    t->mtllTarget = lpr;
+    t->mtllPrio = priority;
+    t->mtllDeleteAfterwards = deleteAfterwards;
+    t->mtllLock = 0;
+    state->mtllController->addContinuation(state, t);
+    }
+
+// The returned Future's made before the continuation's added, in case the
+// continuation runs and releases its own reference at once.
+template<class U>
+Future<U> AnyFuture::then(Looper *lpr, uinta priority, FutureTask<U> *t)
+    {
+    t->mtllController = state->mtllController;
+    Future<U> f(t);
+    then(lpr, priority, t, NO);
+    return f;
+    }
+
+// The closure's task comes from the Controller's pool, like enqueue(lpr, f, priority)'s.
+template<class F>
+auto AnyFuture::then(Looper *lpr, uinta priority, F f) -> Future<decltype(f())>
+    {
+    typedef decltype(f()) U;
+    return then(lpr, priority, state->mtllController->newTask<ClosureFutureTask<U, F>>(static_cast<F&&>(f)));
+    }
+
+#ifdef MTLL_COROUTINES
+template<class T>
+template<class P>
+void Future<T>::await_suspend(std::coroutine_handle<P> h)
+    {
+    CoTask *t = &h.promise();
+    then(t->mtllLooper, t->mtllPriority(), t, NO);
+    }
+#endif
+
+template<class T>
+Future<T> Controller::enqueueFuture(Looper *lpr, FutureTask<T> *t, uinta priority)
+    {
+    return enqueueFuture(lpr, t, priority, 0, NO);
+    }
+
+template<class T>
+Future<T> Controller::enqueueFuture(Looper *lpr, FutureTask<T> *t, uinta priority, Lock *lk, bool exclusive)
+    {
+    t->mtllController = this;
+    Future<T> f(t);
+    enqueue(lpr, t, priority, NO, lk, exclusive);
+    return f;
+    }
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+
 }; // end of namespace MTLL
 #endif // #ifndef MTLL_HPP_
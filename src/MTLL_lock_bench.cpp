@@ -0,0 +1,86 @@
+/*
+ * Copyright 2020 transmission.aquitaine@yahoo.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "MTLL.hpp"
+using namespace MTLL;
+
+
+
+// Reports how much memory an idle Lock costs, and how long creating and deleting
+// one takes.
+// Usage: MTLL_lock_bench [lockCount [maxPriority [numaAware]]]
+
+
+
+static uint64 nowNanos()
+    {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000*(uint64)ts.tv_sec + ts.tv_nsec;
+    }
+
+// Heap bytes in use, including large blocks malloc() gets with mmap().
+static uint64 heapBytes()
+    {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+    }
+
+static uint64 residentBytes()
+    {
+    unsigned long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f)
+        {
+        if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+        fclose(f);
+        }
+    return (uint64)resident*sysconf(_SC_PAGESIZE);
+    }
+
+int main(int argc, char **argv)
+    {
+    const uinta lockCount = argc > 1 ? strtoul(argv[1], 0, 0) : 1000000;
+    const uinta maxPriority = argc > 2 ? strtoul(argv[2], 0, 0) : 7;
+    Options opts;
+    opts.numaAware = argc > 3 && atoi(argv[3]);
+    Controller *c = new Controller(2, maxPriority, &opts);
+    Lock **locks = new Lock*[lockCount];
+
+    const uint64 heapBefore = heapBytes();
+    const uint64 residentBefore = residentBytes();
+    uint64 start = nowNanos();
+    for (uinta i = 0; i < lockCount; i++) locks[i] = new Lock(c);
+    const uint64 createNanos = nowNanos() - start;
+    const uint64 heapAfter = heapBytes();
+    const uint64 residentAfter = residentBytes();
+
+    start = nowNanos();
+    for (uinta i = 0; i < lockCount; i++) c->safeDelete(locks[i]);
+    const uint64 deleteNanos = nowNanos() - start;
+
+    printf("locks %lu maxPriority %lu numaAware %d sizeof(Lock) %lu\n", (unsigned long)lockCount, (unsigned long)maxPriority, (int)opts.numaAware, (unsigned long)sizeof(Lock));
+    printf("heap bytes per idle lock %.1f\n", (double)(heapAfter - heapBefore)/lockCount);
+    printf("resident bytes per idle lock %.1f\n", (double)(residentAfter - residentBefore)/lockCount);
+    printf("create %.1f ns, delete %.1f ns per lock\n", (double)createNanos/lockCount, (double)deleteNanos/lockCount);
+    return 0;
+    }
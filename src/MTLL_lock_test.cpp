@@ -0,0 +1,621 @@
+/*
+ * Copyright 2020 transmission.aquitaine@yahoo.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <sched.h>
+
+#include <stdlib.h>
+
+#include "MTLL_test.hpp"
+
+
+
+// Checks that locks exclude and admit the loopers they should, in each scheduler
+// mode. Prints each failed check and exits with status 1 if there were any. The
+// loopers that the main thread locks and unlocks locks for never run tasks of
+// their own, so the main thread stands in for their tasks.
+// Usage: MTLL_lock_test [threadCount]
+
+
+
+// Which modes a lock can be held in at the same time, as in MTLL.hpp.
+static const bool COMPATIBLE[MODE_SIX + 1][MODE_SIX + 1] =
+    {
+    //  S    X    IS   IX   SIX
+    {YES, NO,  YES, NO,  NO },  // S
+    {NO,  NO,  NO,  NO,  NO },  // X
+    {YES, NO,  YES, YES, YES},  // IS
+    {NO,  NO,  YES, YES, NO },  // IX
+    {NO,  NO,  YES, NO,  NO }   // SIX
+    };
+
+static const char *const MODE_NAMES[MODE_SIX + 1] = {"S", "X", "IS", "IX", "SIX"};
+
+static bool compatible(LockMode held, LockMode requested)
+    {
+    return COMPATIBLE[held][requested];
+    }
+
+
+
+// A Lock that counts the loopers holding it in each mode, as the tasks holding
+// it see them, so that any 2 holding it at once in incompatible modes are seen.
+class TrackedLock : public Lock
+    {
+public:
+    TrackedLock(Controller *c, LockPolicy policy) : Lock(c, 0, policy) { for (uinta m = 0; m <= MODE_SIX; m++) held[m] = 0; }
+    void enter(LockMode mode);
+    void leave(LockMode mode) { __atomic_sub_fetch(held + mode, 1, __ATOMIC_SEQ_CST); }
+
+private:
+    uinta held[MODE_SIX + 1];
+    };
+
+void TrackedLock::enter(LockMode mode)
+    {
+    __atomic_add_fetch(held + mode, 1, __ATOMIC_SEQ_CST);
+    for (uinta m = 0; m <= MODE_SIX; m++)
+        {
+        const uinta others = __atomic_load_n(held + m, __ATOMIC_SEQ_CST) - (m == mode);
+        check(!others || compatible((LockMode)m, mode), "lock held in incompatible modes");
+        }
+    }
+
+// Counts its runs, and checks that the locks given are held by its looper, in a
+// mode that excludes shared requests. The second lock may be the first's child.
+class Probe : public Task
+    {
+public:
+    Probe(uinta *runs, Looper *other, Lock *a, Lock *b) { this->runs = runs; this->other = other; this->a = a; this->b = b; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *runs;
+    Looper *other;
+    Lock *a;
+    Lock *b;
+    };
+
+void Probe::mtllRun(Controller *c, Looper *lpr)
+    {
+    check(!c->attemptLock(other, a, MODE_S), "lock requested with others not held while the task runs");
+    if (b) check(!c->attemptLock(other, b, MODE_S), "lock requested with others not held while the task runs");
+    if (b) c->unlock(lpr, b);
+    c->unlock(lpr, a);
+    __atomic_add_fetch(runs, 1, __ATOMIC_SEQ_CST);
+    }
+
+// What a Step saw when it ran. Its order's 0 until it's run.
+class Outcome
+    {
+public:
+    Outcome() { order = 0; refused = NO; }
+
+    uinta order;
+    bool refused;
+    };
+
+// Records the order it ran in, and whether its lock request was refused, then
+// releases the lock unless it's to be left held.
+class Step : public Task
+    {
+public:
+    Step(uinta *sequence, Outcome *outcome, Lock *lk, bool release) { this->sequence = sequence; this->outcome = outcome; this->lk = lk; this->release = release; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *sequence;
+    Outcome *outcome;
+    Lock *lk;
+    bool release;
+    };
+
+void Step::mtllRun(Controller *c, Looper *lpr)
+    {
+    outcome->refused = mtllLockRefused();
+    const uinta order = __atomic_add_fetch(sequence, 1, __ATOMIC_SEQ_CST);
+    if (release) c->unlock(lpr, lk);
+    __atomic_store_n(&outcome->order, order, __ATOMIC_SEQ_CST);
+    }
+
+
+
+// A looper asking for 2 locks, one of which is held, holds neither while it
+// waits, and holds both once it's let in.
+static void testMultiLockAllOrNothing(Controller *c)
+    {
+    Lock *a = new Lock(c);
+    Lock *b = new Lock(c);
+    Looper *holder = new Looper();
+    Looper *waiter = new Looper();
+    Looper *other = new Looper();
+    check(c->attemptLock(holder, b, MODE_X), "free lock refused");
+    uinta runs = 0;
+    LockRequest requests[2] = {LockRequest(a, YES), LockRequest(b, YES)};
+    c->enqueue(waiter, new Probe(&runs, other, a, b), 1, YES, requests, 2);
+    settle();
+    check(!runs, "task run without all its locks");
+    check(c->attemptLock(other, a, MODE_X), "lock held by a looper waiting for another");
+    c->unlock(other, a);
+    c->unlock(holder, b);
+    check(waitFor(&runs, 1), "task not run once its locks were free");
+    check(c->attemptLock(other, a, MODE_X) && c->attemptLock(other, b, MODE_X), "locks still held after unlock");
+    c->unlock(other, a);
+    c->unlock(other, b);
+    c->safeDelete(holder);
+    c->safeDelete(waiter);
+    c->safeDelete(other);
+    c->safeDelete(a);
+    c->safeDelete(b);
+    }
+
+// Checks that all the given locks are held while it runs, then releases them.
+class MultiProbe : public Task
+    {
+public:
+    MultiProbe(uinta *runs, Looper *other, Lock **locks, uinta count) { this->runs = runs; this->other = other; this->locks = locks; this->count = count; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *runs;
+    Looper *other;
+    Lock **locks;
+    uinta count;
+    };
+
+void MultiProbe::mtllRun(Controller *c, Looper *lpr)
+    {
+    for (uinta i = 0; i < count; i++)
+        {
+        check(!c->attemptLock(other, locks[i], MODE_S), "lock requested with others not held while the task runs");
+        c->unlock(lpr, locks[i]);
+        }
+    __atomic_add_fetch(runs, 1, __ATOMIC_SEQ_CST);
+    }
+
+// The requests are made in a local array, and scribbled over once they've been
+// made, before the task can run.
+static void enqueueWithLocks(Controller *c, Looper *lpr, Task *t, Lock **locks, uinta count)
+    {
+    LockRequest requests[8];
+    for (uinta i = 0; i < count; i++) requests[i] = LockRequest(locks[count - 1 - i], YES);
+    c->enqueue(lpr, t, 1, YES, requests, count);
+    for (uinta i = 0; i < count; i++) requests[i] = LockRequest(locks[0], NO);
+    }
+
+// A task's lock requests are copied when it's enqueued, whether there are few or
+// many of them.
+static void testMultiLockRequestsCopied(Controller *c)
+    {
+    Lock *locks[8];
+    for (uinta i = 0; i < 8; i++) locks[i] = new Lock(c);
+    Looper *holder = new Looper();
+    Looper *waiter = new Looper();
+    Looper *other = new Looper();
+    const uinta counts[2] = {2, 8};
+    uinta runs = 0;
+    for (uinta i = 0; i < 2; i++)
+        {
+        const uinta count = counts[i];
+        check(c->attemptLock(holder, locks[count - 1], MODE_X), "free lock refused");
+        enqueueWithLocks(c, waiter, new MultiProbe(&runs, other, locks, count), locks, count);
+        settle();
+        check(runs == i, "task run without all its locks");
+        c->unlock(holder, locks[count - 1]);
+        check(waitFor(&runs, i + 1), "task not run once its locks were free");
+        }
+    for (uinta i = 0; i < 8; i++)
+        {
+        check(c->attemptLock(other, locks[i], MODE_X), "lock still held after unlock");
+        c->unlock(other, locks[i]);
+        }
+    c->safeDelete(holder);
+    c->safeDelete(waiter);
+    c->safeDelete(other);
+    for (uinta i = 0; i < 8; i++) c->safeDelete(locks[i]);
+    }
+
+// Asks for a lock in shared mode without waiting, at its task's priority, and
+// records whether it got it.
+class Attempt : public Task
+    {
+public:
+    Attempt(Outcome *outcome, Lock *lk) { this->outcome = outcome; this->lk = lk; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    Outcome *outcome;
+    Lock *lk;
+    };
+
+void Attempt::mtllRun(Controller *c, Looper *lpr)
+    {
+    outcome->refused = !c->attemptLock(lpr, lk, MODE_S);
+    if (!outcome->refused) c->unlock(lpr, lk);
+    __atomic_store_n(&outcome->order, 1, __ATOMIC_SEQ_CST);
+    }
+
+// Whether a shared request at the given priority's let in, while the lock's held
+// in shared mode and an exclusive request's waiting at priority 1.
+static bool sharedAdmitted(Controller *c, LockPolicy policy, uinta priority)
+    {
+    Lock *lk = new Lock(c, 0, policy);
+    Looper *holder = new Looper();
+    Looper *writer = new Looper();
+    Looper *reader = new Looper();
+    check(c->attemptLock(holder, lk, MODE_S), "free lock refused");
+    uinta sequence = 0;
+    Outcome written, attempted;
+    c->enqueue(writer, new Step(&sequence, &written, lk, YES), 1, YES, lk, YES);
+    settle();
+    c->enqueue(reader, new Attempt(&attempted, lk), priority, YES);
+    check(waitFor(&attempted.order, 1), "attempt not run");
+    c->unlock(holder, lk);
+    check(waitFor(&written.order, 1), "exclusive waiter not let in once the lock was free");
+    c->safeDelete(holder);
+    c->safeDelete(writer);
+    c->safeDelete(reader);
+    c->safeDelete(lk);
+    return !attempted.refused;
+    }
+
+// The order 2 exclusive requests and then a higher priority shared request are
+// granted in, starting while the lock's held in shared mode. Writer preferring
+// lets the shared request in at once, phase fair lets it in between the
+// exclusive requests, and FIFO lets it in last.
+static void grantOrder(Controller *c, LockPolicy policy, uinta *firstWriter, uinta *secondWriter, uinta *reader)
+    {
+    Lock *lk = new Lock(c, 0, policy);
+    Looper *holder = new Looper();
+    Looper *loopers[3];
+    Outcome outcomes[3];
+    uinta sequence = 0;
+    check(c->attemptLock(holder, lk, MODE_S), "free lock refused");
+    for (uinta i = 0; i < 3; i++)
+        {
+        loopers[i] = new Looper();
+        c->enqueue(loopers[i], new Step(&sequence, outcomes + i, lk, YES), i < 2 ? 0 : 2, YES, lk, i < 2);
+        settle();
+        }
+    c->unlock(holder, lk);
+    for (uinta i = 0; i < 3; i++) check(waitFor(&outcomes[i].order, 1), "waiters not all let in once the lock was free");
+    *firstWriter = outcomes[0].order;
+    *secondWriter = outcomes[1].order;
+    *reader = outcomes[2].order;
+    c->safeDelete(holder);
+    for (uinta i = 0; i < 3; i++) c->safeDelete(loopers[i]);
+    c->safeDelete(lk);
+    }
+
+static void testPolicies(Controller *c)
+    {
+    check(sharedAdmitted(c, POLICY_WRITER_PREFERRING, 2), "writer preferring refused a shared request above an exclusive waiter");
+    check(!sharedAdmitted(c, POLICY_WRITER_PREFERRING, 1), "writer preferring let a shared request past an exclusive waiter");
+    check(!sharedAdmitted(c, POLICY_PHASE_FAIR, 2), "phase fair let a shared request past an exclusive waiter");
+    check(!sharedAdmitted(c, POLICY_FIFO, 2), "FIFO let a shared request past an exclusive waiter");
+    uinta firstWriter, secondWriter, reader;
+    grantOrder(c, POLICY_WRITER_PREFERRING, &firstWriter, &secondWriter, &reader);
+    check(reader == 1 && firstWriter == 2 && secondWriter == 3, "writer preferring granted the lock out of order");
+    grantOrder(c, POLICY_PHASE_FAIR, &firstWriter, &secondWriter, &reader);
+    check(firstWriter == 1 && reader == 2 && secondWriter == 3, "phase fair granted the lock out of order");
+    grantOrder(c, POLICY_FIFO, &firstWriter, &secondWriter, &reader);
+    check(firstWriter == 1 && secondWriter == 2 && reader == 3, "FIFO granted the lock out of order");
+    }
+
+// With aging an exclusive waiter at priority 0 is soon promoted past priority 1,
+// so a shared request at priority 1 is no longer let past it.
+static void testAging(Controller *c)
+    {
+    Lock *lk = new Lock(c);
+    Looper *holder = new Looper();
+    Looper *writer = new Looper();
+    Looper *reader = new Looper();
+    check(c->attemptLock(holder, lk, MODE_S), "free lock refused");
+    uinta sequence = 0;
+    Outcome written, before, after;
+    c->enqueue(writer, new Step(&sequence, &written, lk, YES), 0, YES, lk, YES);
+    c->enqueue(reader, new Attempt(&before, lk), 1, YES);
+    check(waitFor(&before.order, 1) && !before.refused, "shared request refused before the exclusive waiter aged");
+    usleep(100000);
+    c->enqueue(reader, new Attempt(&after, lk), 1, YES);
+    check(waitFor(&after.order, 1) && after.refused, "exclusive waiter not promoted");
+    c->unlock(holder, lk);
+    check(waitFor(&written.order, 1), "exclusive waiter not let in once the lock was free");
+    c->safeDelete(holder);
+    c->safeDelete(writer);
+    c->safeDelete(reader);
+    c->safeDelete(lk);
+    }
+
+// Each mode a lock's held in admits exactly the modes compatible with it.
+static void testModeCompatibility(Controller *c)
+    {
+    Lock *lk = new Lock(c);
+    Looper *holder = new Looper();
+    Looper *requester = new Looper();
+    for (uinta held = 0; held <= MODE_SIX; held++)
+        for (uinta requested = 0; requested <= MODE_SIX; requested++)
+            {
+            char what[64];
+            check(c->attemptLock(holder, lk, (LockMode)held), "free lock refused");
+            const bool granted = c->attemptLock(requester, lk, (LockMode)requested);
+            snprintf(what, sizeof(what), "%s request %s while held in %s", MODE_NAMES[requested], granted ? "granted" : "refused", MODE_NAMES[held]);
+            check(granted == compatible((LockMode)held, (LockMode)requested), what);
+            if (granted) c->unlock(requester, lk);
+            c->unlock(holder, lk);
+            }
+    c->safeDelete(holder);
+    c->safeDelete(requester);
+    c->safeDelete(lk);
+    }
+
+// A looper holding a parent in shared mode holds up a looper updating a child,
+// which asks for the parent in IX mode, but not a reader taking the parent in
+// IS mode and the child in shared mode. Loopers updating different children
+// don't hold each other up.
+static void testHierarchy(Controller *c)
+    {
+    Lock *parent = new Lock(c);
+    Lock *child = new Lock(c, parent, POLICY_WRITER_PREFERRING);
+    Lock *sibling = new Lock(c, parent, POLICY_WRITER_PREFERRING);
+    Looper *scanner = new Looper();
+    Looper *updater = new Looper();
+    Looper *other = new Looper();
+    check(c->attemptLock(scanner, parent, MODE_S), "free lock refused");
+    check(c->attemptLock(other, parent, MODE_IS) && c->attemptLock(other, child, MODE_S), "reader held up by a shared holder of the parent");
+    uinta runs = 0;
+    LockRequest requests[2] = {LockRequest(parent, MODE_IX), LockRequest(child, MODE_X)};
+    c->enqueue(updater, new Probe(&runs, other, parent, child), 1, YES, requests, 2);
+    c->unlock(other, child);
+    c->unlock(other, parent);
+    settle();
+    check(!runs, "child updated while its parent's held in shared mode");
+    c->unlock(scanner, parent);
+    check(waitFor(&runs, 1), "child not updated once its parent was free");
+
+    Looper *updaters[2] = {updater, other};
+    Lock *children[2] = {child, sibling};
+    LockRequest siblingRequests[2][2];
+    uinta sequence = 0;
+    Outcome updated[2];
+    for (uinta i = 0; i < 2; i++)
+        {
+        siblingRequests[i][0] = LockRequest(parent, MODE_IX);
+        siblingRequests[i][1] = LockRequest(children[i], MODE_X);
+        c->enqueue(updaters[i], new Step(&sequence, updated + i, children[i], NO), 1, YES, siblingRequests[i], 2);
+        }
+    check(waitFor(&sequence, 2), "loopers updating different children held each other up");
+    for (uinta i = 0; i < 2; i++)
+        {
+        c->unlock(updaters[i], children[i]);
+        c->unlock(updaters[i], parent);
+        }
+    c->safeDelete(scanner);
+    c->safeDelete(updater);
+    c->safeDelete(other);
+    c->safeDelete(child);
+    c->safeDelete(sibling);
+    c->safeDelete(parent);
+    }
+
+// A looper upgrading a lock waits, still holding it, until the other shared
+// holder's let go, and then goes ahead of a higher priority exclusive waiter.
+static void testUpgrade(Controller *c)
+    {
+    Lock *lk = new Lock(c);
+    Looper *upgrader = new Looper();
+    Looper *reader = new Looper();
+    Looper *writer = new Looper();
+    Looper *other = new Looper();
+    check(c->attemptLock(upgrader, lk, MODE_S) && c->attemptLock(reader, lk, MODE_S), "free lock refused");
+    uinta sequence = 0;
+    Outcome upgraded, written;
+    c->enqueue(writer, new Step(&sequence, &written, lk, YES), 1, YES, lk, YES);
+    settle();
+    c->enqueueUpgrade(upgrader, new Step(&sequence, &upgraded, lk, NO), 0, YES, lk);
+    settle();
+    check(!upgraded.order, "lock upgraded while another looper held it");
+    check(!c->attemptLock(other, lk, MODE_S), "shared request let in ahead of an upgrade");
+    c->unlock(reader, lk);
+    check(waitFor(&upgraded.order, 1), "upgrade not granted once the other holder let go");
+    check(!upgraded.refused, "only upgrade refused");
+    check(!c->attemptLock(other, lk, MODE_S), "upgraded lock still shared");
+    check(!written.order, "exclusive waiter let in ahead of an upgrade");
+    c->unlock(upgrader, lk);
+    check(waitFor(&written.order, 1), "exclusive waiter not let in after the upgrader let go");
+    c->safeDelete(upgrader);
+    c->safeDelete(reader);
+    c->safeDelete(writer);
+    c->safeDelete(other);
+    c->safeDelete(lk);
+    }
+
+// Only 1 looper at a time can wait to upgrade a lock. A second's refused, and its
+// task runs still holding the lock in shared mode.
+static void testSecondUpgradeRefused(Controller *c)
+    {
+    Lock *lk = new Lock(c);
+    Looper *first = new Looper();
+    Looper *second = new Looper();
+    check(c->attemptLock(first, lk, MODE_S) && c->attemptLock(second, lk, MODE_S), "free lock refused");
+    uinta sequence = 0;
+    Outcome firstUpgraded, secondUpgraded;
+    c->enqueueUpgrade(first, new Step(&sequence, &firstUpgraded, lk, YES), 1, YES, lk);
+    settle();
+    c->enqueueUpgrade(second, new Step(&sequence, &secondUpgraded, lk, YES), 1, YES, lk);
+    check(waitFor(&secondUpgraded.order, 1), "second upgrade neither granted nor refused");
+    check(secondUpgraded.refused, "second upgrade not refused");
+    check(waitFor(&firstUpgraded.order, 1), "upgrade not granted once the refused upgrader let go");
+    check(!firstUpgraded.refused && secondUpgraded.order < firstUpgraded.order, "first upgrade refused");
+    c->safeDelete(first);
+    c->safeDelete(second);
+    c->safeDelete(lk);
+    }
+
+// A looper downgrading a lock keeps holding it in shared mode, and lets in a
+// shared waiter but not a lower priority exclusive one.
+static void testDowngrade(Controller *c)
+    {
+    Lock *lk = new Lock(c);
+    Looper *holder = new Looper();
+    Looper *reader = new Looper();
+    Looper *writer = new Looper();
+    Looper *other = new Looper();
+    check(c->attemptLock(holder, lk, MODE_X), "free lock refused");
+    uinta sequence = 0;
+    Outcome read, written;
+    c->enqueue(writer, new Step(&sequence, &written, lk, YES), 0, YES, lk, YES);
+    c->enqueue(reader, new Step(&sequence, &read, lk, NO), 1, YES, lk, NO);
+    settle();
+    check(!read.order && !written.order, "exclusively held lock let in a waiter");
+    c->downgrade(holder, lk);
+    check(waitFor(&read.order, 1), "shared waiter not let in after a downgrade");
+    settle();
+    check(!written.order, "exclusive waiter let in while the lock's still shared");
+    check(!c->attemptLock(other, lk, MODE_X), "downgraded lock not still held");
+    c->unlock(holder, lk);
+    c->unlock(reader, lk);
+    check(waitFor(&written.order, 1), "exclusive waiter not let in after the shared holders let go");
+    c->safeDelete(holder);
+    c->safeDelete(reader);
+    c->safeDelete(writer);
+    c->safeDelete(other);
+    c->safeDelete(lk);
+    }
+
+
+
+static const uinta STRESS_LOCKS = 6;
+static const uinta STRESS_LOOPERS = 32;
+static const uinta STRESS_ROUNDS = 500;
+
+class StressRun
+    {
+public:
+    TrackedLock *locks[STRESS_LOCKS];
+    const LockMode *modes;
+    uinta modeCount;
+    uinta finished;
+    };
+
+// Asks for 1 to 3 of the run's locks, in random modes, and on each run checks
+// that they're held compatibly with the other holders before asking again. It's
+// deleted after its last run.
+class StressTask : public Task
+    {
+public:
+    StressTask(StressRun *run, unsigned seed) { this->run = run; this->seed = seed; left = STRESS_ROUNDS; }
+    void pick();
+    void mtllRun(Controller *c, Looper *lpr);
+
+    LockRequest requests[3];
+    uinta count;
+
+private:
+    StressRun *run;
+    unsigned seed;
+    uinta left;
+    };
+
+void StressTask::pick()
+    {
+    count = 1 + rand_r(&seed)%3;
+    for (uinta i = 0; i < count; i++)
+        {
+        TrackedLock *lk;
+        bool duplicate;
+        do
+            {
+            lk = run->locks[rand_r(&seed)%STRESS_LOCKS];
+            duplicate = NO;
+            for (uinta j = 0; j < i; j++)
+                if (requests[j].lk == lk) duplicate = YES;
+            }
+        while (duplicate);
+        requests[i] = LockRequest(lk, run->modes[rand_r(&seed)%run->modeCount]);
+        }
+    }
+
+void StressTask::mtllRun(Controller *c, Looper *lpr)
+    {
+    for (uinta i = 0; i < count; i++) ((TrackedLock*)requests[i].lk)->enter(requests[i].mode);
+    sched_yield();
+    for (uinta i = 0; i < count; i++)
+        {
+        ((TrackedLock*)requests[i].lk)->leave(requests[i].mode);
+        c->unlock(lpr, requests[i].lk);
+        }
+    if (--left)
+        {
+        pick();
+        c->enqueue(lpr, this, rand_r(&seed)%3, left == 1, requests, count);
+        }
+    else
+        __atomic_add_fetch(&run->finished, 1, __ATOMIC_SEQ_CST);
+    }
+
+// Many loopers asking for overlapping sets of locks at once all get through.
+static void stress(Controller *c, const LockMode *modes, uinta modeCount, LockPolicy policy)
+    {
+    StressRun run;
+    for (uinta i = 0; i < STRESS_LOCKS; i++) run.locks[i] = new TrackedLock(c, policy);
+    run.modes = modes;
+    run.modeCount = modeCount;
+    run.finished = 0;
+    Looper *loopers[STRESS_LOOPERS];
+    for (uinta i = 0; i < STRESS_LOOPERS; i++)
+        {
+        StressTask *t = new StressTask(&run, i + 1);
+        loopers[i] = new Looper();
+        t->pick();
+        c->enqueue(loopers[i], t, i%3, NO, t->requests, t->count);
+        }
+    const bool done = waitFor(&run.finished, STRESS_LOOPERS);
+    check(done, "stress run didn't finish");
+    if (!done) return;
+    for (uinta i = 0; i < STRESS_LOOPERS; i++) c->safeDelete(loopers[i]);
+    for (uinta i = 0; i < STRESS_LOCKS; i++) c->safeDelete(run.locks[i]);
+    }
+
+static const LockMode SHARED_EXCLUSIVE[] = {MODE_S, MODE_X, MODE_X};
+static const LockMode ALL_MODES[] = {MODE_S, MODE_X, MODE_IS, MODE_IX, MODE_SIX};
+
+
+
+int main(int argc, char **argv)
+    {
+    const uinta threadCount = argc > 1 ? strtoul(argv[1], 0, 0) : 4;
+    for (uinta mode = 0; mode < SCHEDULER_MODE_COUNT; mode++)
+        {
+        Options opts;
+        currentMode = schedulerMode(mode, &opts, threadCount);
+        Controller *c = new Controller(threadCount, 2, &opts);
+        testMultiLockAllOrNothing(c);
+        testMultiLockRequestsCopied(c);
+        testUpgrade(c);
+        testSecondUpgradeRefused(c);
+        testDowngrade(c);
+        testModeCompatibility(c);
+        testHierarchy(c);
+        testPolicies(c);
+        opts.lockAgingMicros = 20000;
+        testAging(new Controller(threadCount, 2, &opts));
+        for (uinta policy = POLICY_WRITER_PREFERRING; policy <= POLICY_FIFO; policy++)
+            {
+            stress(c, SHARED_EXCLUSIVE, 3, (LockPolicy)policy);
+            stress(c, ALL_MODES, 5, (LockPolicy)policy);
+            }
+        }
+    return report("lock");
+    }
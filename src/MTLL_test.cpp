@@ -0,0 +1,1475 @@
+/*
+ * Copyright 2020 transmission.aquitaine@yahoo.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MTLL_test.hpp"
+
+
+
+// Checks that tasks are scheduled as they should be, including those run for
+// timers and I/O, in each scheduler mode.
+// Prints each failed check and exits with status 1 if there were any. The lock
+// checks are in MTLL_lock_test.
+// Usage: MTLL_test [threadCount]
+
+
+
+// Counts the tasks running at once, and the most there have been.
+class Concurrency
+    {
+public:
+    Concurrency() { running = most = finished = 0; }
+    void enter();
+    void leave();
+
+    uinta running;
+    uinta most;
+    uinta finished;
+    };
+
+void Concurrency::enter()
+    {
+    const uinta now = __atomic_add_fetch(&running, 1, __ATOMIC_SEQ_CST);
+    uinta most = __atomic_load_n(&this->most, __ATOMIC_SEQ_CST);
+    while (now > most && !__atomic_compare_exchange_n(&this->most, &most, now, NO, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) { }
+    }
+
+void Concurrency::leave()
+    {
+    __atomic_sub_fetch(&running, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&finished, 1, __ATOMIC_SEQ_CST);
+    }
+
+// Keeps its thread busy for a while, without running on the CPU, so that other
+// workers get to run tasks meanwhile even on a single CPU.
+class Sleeper : public Task
+    {
+public:
+    Sleeper(Concurrency *concurrency, uinta micros) { this->concurrency = concurrency; this->micros = micros; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    Concurrency *concurrency;
+    uinta micros;
+    };
+
+void Sleeper::mtllRun(Controller *c, Looper *lpr)
+    {
+    concurrency->enter();
+    usleep(micros);
+    concurrency->leave();
+    }
+
+// Enqueues sleepers on new loopers from a worker, which in work stealing mode
+// puts them on its own ready queue.
+class Spawner : public Task
+    {
+public:
+    Spawner(Concurrency *concurrency, uinta count) { this->concurrency = concurrency; this->count = count; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    Concurrency *concurrency;
+    uinta count;
+    };
+
+void Spawner::mtllRun(Controller *c, Looper *lpr)
+    {
+    for (uinta i = 0; i < count; i++)
+        {
+        Looper *sleeper = new Looper();
+        c->enqueue(sleeper, new Sleeper(concurrency, 30000), 1, YES);
+        c->safeDelete(sleeper);
+        }
+    }
+
+// Loopers made ready by 1 worker are shared out to the other, idle, workers.
+static void testSpread(Controller *c, uinta threadCount)
+    {
+    const uinta count = 2*threadCount;
+    Concurrency concurrency;
+    Looper *lpr = new Looper();
+    c->enqueue(lpr, new Spawner(&concurrency, count), 1, YES);
+    check(waitFor(&concurrency.finished, count), "loopers made ready by a worker not all run");
+    check(threadCount == 1 || concurrency.most > 1, "loopers made ready by a worker only run by 1 worker");
+    c->safeDelete(lpr);
+    }
+
+// A looper that records when it's deleted, and how many tasks had finished by
+// then.
+class WatchedLooper : public Looper
+    {
+public:
+    WatchedLooper(uinta *deleted, uinta *finished, uinta *finishedBefore) { this->deleted = deleted; this->finished = finished; this->finishedBefore = finishedBefore; }
+
+protected:
+    ~WatchedLooper();
+
+private:
+    uinta *deleted;
+    uinta *finished;
+    uinta *finishedBefore;
+    };
+
+WatchedLooper::~WatchedLooper()
+    {
+    __atomic_store_n(finishedBefore, __atomic_load_n(finished, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(deleted, 1, __ATOMIC_SEQ_CST);
+    }
+
+static const uinta PRODUCERS = 4;
+static const uinta PRODUCED_LOOPERS = 8;
+static const uinta PRODUCED_TASKS = 1000;
+
+// The tasks each producer's enqueued on a looper so far, as seen by the tasks
+// themselves when they run.
+class ProducedLooper
+    {
+public:
+    ProducedLooper() { lpr = new Looper(); running = 0; for (uinta i = 0; i < PRODUCERS; i++) next[i] = 0; }
+
+    Looper *lpr;
+    uinta running;
+    uinta next[PRODUCERS];
+    };
+
+// Checks that it runs alone on its looper, and after the tasks its producer
+// enqueued on the looper before it.
+class Produced : public Task
+    {
+public:
+    Produced(ProducedLooper *target, uinta producer, uinta sequence, uinta *done) { this->target = target; this->producer = producer; this->sequence = sequence; this->done = done; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    ProducedLooper *target;
+    uinta producer;
+    uinta sequence;
+    uinta *done;
+    };
+
+void Produced::mtllRun(Controller *c, Looper *lpr)
+    {
+    check(__atomic_add_fetch(&target->running, 1, __ATOMIC_SEQ_CST) == 1, "2 tasks of 1 looper run at once");
+    check(target->next[producer] == sequence, "tasks enqueued by 1 thread run out of order");
+    target->next[producer] = sequence + 1;
+    __atomic_sub_fetch(&target->running, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(done, 1, __ATOMIC_SEQ_CST);
+    }
+
+class Producer
+    {
+public:
+    Controller *c;
+    ProducedLooper *targets;
+    uinta index;
+    uinta *done;
+    };
+
+static void *produce(void *context)
+    {
+    Producer *p = (Producer*)context;
+    for (uinta i = 0; i < PRODUCED_TASKS; i++)
+        for (uinta j = 0; j < PRODUCED_LOOPERS; j++)
+            p->c->enqueue(p->targets[j].lpr, new Produced(p->targets + j, p->index, i, p->done), 1, YES);
+    return 0;
+    }
+
+// Threads enqueueing on the same loopers at once each see their own tasks run
+// in the order they enqueued them, and never 2 of a looper's at once.
+static void testProducers(Controller *c)
+    {
+    ProducedLooper targets[PRODUCED_LOOPERS];
+    Producer producers[PRODUCERS];
+    pthread_t threads[PRODUCERS];
+    uinta done = 0;
+    for (uinta i = 0; i < PRODUCERS; i++)
+        {
+        producers[i].c = c;
+        producers[i].targets = targets;
+        producers[i].index = i;
+        producers[i].done = &done;
+        const int created = pthread_create(threads + i, 0, produce, producers + i);
+        assert(!created);
+        (void)created;
+        }
+    for (uinta i = 0; i < PRODUCERS; i++) pthread_join(threads[i], 0);
+    check(waitFor(&done, PRODUCERS*PRODUCED_LOOPERS*PRODUCED_TASKS), "tasks enqueued by several threads not all run");
+    for (uinta i = 0; i < PRODUCED_LOOPERS; i++) c->safeDelete(targets[i].lpr);
+    }
+
+// An idle looper's deleted at once, a busy one once its tasks have all run.
+static void testDeleteBusyLooper(Controller *c)
+    {
+    uinta deleted = 0;
+    uinta finishedBefore = 0;
+    Concurrency concurrency;
+    c->safeDelete(new WatchedLooper(&deleted, &concurrency.finished, &finishedBefore));
+    check(__atomic_load_n(&deleted, __ATOMIC_SEQ_CST) == 1, "idle looper not deleted at once");
+    Looper *busy = new WatchedLooper(&deleted, &concurrency.finished, &finishedBefore);
+    for (uinta i = 0; i < 3; i++) c->enqueue(busy, new Sleeper(&concurrency, 10000), 1, YES);
+    c->safeDelete(busy);
+    check(waitFor(&deleted, 2), "busy looper not deleted once its tasks had run");
+    check(__atomic_load_n(&finishedBefore, __ATOMIC_SEQ_CST) == 3, "busy looper deleted before its tasks had all run");
+    }
+
+
+static const uinta BATCH_LOOPERS = 16;
+static const uinta BATCH_ROUNDS = 3;
+
+// A batch's tasks on 1 looper, as seen by the tasks themselves when they run.
+// The tasks holding the lock count themselves in holders, to see that it's
+// held exclusively.
+class BatchRun
+    {
+public:
+    BatchRun() { lk = 0; holders = done = 0; for (uinta i = 0; i < BATCH_LOOPERS; i++) next[i] = 0; }
+
+    Lock *lk;
+    uinta holders;
+    uinta done;
+    uinta next[BATCH_LOOPERS];
+    };
+
+class Batched : public Task
+    {
+public:
+    Batched(BatchRun *run, uinta looper, uinta round) { this->run = run; this->looper = looper; this->round = round; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    BatchRun *run;
+    uinta looper;
+    uinta round;
+    };
+
+void Batched::mtllRun(Controller *c, Looper *lpr)
+    {
+    check(run->next[looper] == round, "batched tasks on 1 looper run out of order");
+    run->next[looper] = round + 1;
+    if (round & 1)
+        {
+        check(__atomic_add_fetch(&run->holders, 1, __ATOMIC_SEQ_CST) == 1, "batched task's exclusive lock held by another");
+        usleep(100);
+        __atomic_sub_fetch(&run->holders, 1, __ATOMIC_SEQ_CST);
+        c->unlock(lpr, run->lk);
+        }
+    __atomic_add_fetch(&run->done, 1, __ATOMIC_SEQ_CST);
+    }
+
+// Fills in and enqueues a batch with rounds of tasks on each looper, every
+// other round requesting the lock.
+static void enqueueRounds(Controller *c, BatchRun *run, Looper **loopers)
+    {
+    BatchEntry entries[BATCH_LOOPERS*BATCH_ROUNDS];
+    for (uinta i = 0; i < BATCH_ROUNDS; i++)
+        for (uinta j = 0; j < BATCH_LOOPERS; j++)
+            {
+            Task *t = new Batched(run, j, i);
+            entries[i*BATCH_LOOPERS + j] = i & 1 ? BatchEntry(loopers[j], t, j%3, YES, run->lk, YES) : BatchEntry(loopers[j], t, j%3, YES);
+            }
+    c->enqueueBatch(entries, BATCH_LOOPERS*BATCH_ROUNDS);
+    }
+
+// Enqueues a batch from a worker, which makes its loopers ready on its own queue
+// in work stealing mode.
+class BatchSender : public Task
+    {
+public:
+    BatchSender(BatchRun *run, Looper **loopers) { this->run = run; this->loopers = loopers; }
+    void mtllRun(Controller *c, Looper *lpr) { enqueueRounds(c, run, loopers); }
+
+private:
+    BatchRun *run;
+    Looper **loopers;
+    };
+
+// A batch runs each looper's tasks in the order they're in the batch, and grants
+// the locks they ask for, whether it's enqueued from a worker or another thread.
+static void testBatch(Controller *c)
+    {
+    for (uinta fromWorker = 0; fromWorker < 2; fromWorker++)
+        {
+        BatchRun run;
+        Looper *loopers[BATCH_LOOPERS];
+        for (uinta i = 0; i < BATCH_LOOPERS; i++) loopers[i] = new Looper();
+        run.lk = new Lock(c);
+        Looper *sender = new Looper();
+        if (fromWorker)
+            c->enqueue(sender, new BatchSender(&run, loopers), 1, YES);
+        else
+            enqueueRounds(c, &run, loopers);
+        check(waitFor(&run.done, BATCH_LOOPERS*BATCH_ROUNDS), "batched tasks not all run");
+        for (uinta i = 0; i < BATCH_LOOPERS; i++) c->safeDelete(loopers[i]);
+        c->safeDelete(sender);
+        c->safeDelete(run.lk);
+        }
+    }
+
+
+// A Controller with a single worker, so that the order tasks run in can be
+// predicted.
+static Controller *singleWorker(const Options *opts, uinta maxPriority)
+    {
+    Options single = *opts;
+    single.maxThreads = 1;
+    return new Controller(1, maxPriority, &single);
+    }
+
+// Holds up its worker until it's opened.
+class Gate : public Task
+    {
+public:
+    Gate(uinta *open) { this->open = open; }
+    void mtllRun(Controller *c, Looper *lpr) { while (!__atomic_load_n(open, __ATOMIC_SEQ_CST)) usleep(100); }
+
+private:
+    uinta *open;
+    };
+
+// Which loopers' tasks ran, in the order they ran. The count's of the entries
+// that have been filled in.
+class RunLog
+    {
+public:
+    RunLog() { claimed = count = 0; }
+    void add(uinta id);
+
+    uinta claimed;
+    uinta count;
+    uinta ids[64];
+    };
+
+void RunLog::add(uinta id)
+    {
+    ids[__atomic_fetch_add(&claimed, 1, __ATOMIC_SEQ_CST)] = id;
+    __atomic_add_fetch(&count, 1, __ATOMIC_SEQ_CST);
+    }
+
+class Logged : public Task
+    {
+public:
+    Logged(RunLog *log, uinta id, uinta micros) { this->log = log; this->id = id; this->micros = micros; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    RunLog *log;
+    uinta id;
+    uinta micros;
+    };
+
+void Logged::mtllRun(Controller *c, Looper *lpr)
+    {
+    if (micros) usleep(micros);
+    log->add(id);
+    }
+
+static const uinta QUANTUM_TASKS = 8;
+
+// Runs 2 loopers' tasks, queued while the only worker's held up, and returns
+// the order they ran in. A looper's quantum's only set if tasks isn't 0.
+static void runQuanta(Controller *c, uinta tasks, uinta micros, uinta taskMicros, RunLog *log)
+    {
+    uinta open = 0;
+    Looper *gate = new Looper();
+    Looper *loopers[2];
+    c->enqueue(gate, new Gate(&open), 1, YES);
+    for (uinta i = 0; i < 2; i++)
+        {
+        loopers[i] = new Looper();
+        if (tasks) c->setQuantum(loopers[i], tasks, micros);
+        }
+    for (uinta i = 0; i < 2; i++) for (uinta j = 0; j < QUANTUM_TASKS; j++) c->enqueue(loopers[i], new Logged(log, i, taskMicros), 1, YES);
+    __atomic_store_n(&open, 1, __ATOMIC_SEQ_CST);
+    check(waitFor(&log->count, 2*QUANTUM_TASKS), "tasks not all run");
+    c->safeDelete(gate);
+    for (uinta i = 0; i < 2; i++) c->safeDelete(loopers[i]);
+    }
+
+// Whether each looper's tasks ran in runs of a whole number of quanta, apart
+// from its last run, and the first looper was made to give way to the other
+// after its first quantum.
+static bool ranInQuanta(const RunLog *log, uinta quantum)
+    {
+    uinta ran[2] = {0, 0};
+    for (uinta i = 0; i < log->count; )
+        {
+        const uinta id = log->ids[i];
+        uinta j = i;
+        while (j < log->count && log->ids[j] == id) j++;
+        ran[id] += j - i;
+        if ((j - i)%quantum && ran[id] != QUANTUM_TASKS) return NO;
+        if (!i && j - i != quantum) return NO;
+        i = j;
+        }
+    return YES;
+    }
+
+// A worker runs up to a quantum of a looper's tasks before it gives way to
+// other loopers at the same priority. The quantum's the looper's own, or the
+// Controller's, and may be limited in time rather than tasks.
+static void testQuantum(const Options *opts)
+    {
+    Controller *c = singleWorker(opts, 2);
+    RunLog own, controllers, timed;
+    runQuanta(c, 4, 0, 0, &own);
+    check(ranInQuanta(&own, 4), "looper's own quantum not kept to");
+    runQuanta(c, 0, 0, 0, &controllers);
+    check(ranInQuanta(&controllers, opts->quantumTasks ? opts->quantumTasks : 1), "Controller's quantum not kept to");
+    runQuanta(c, QUANTUM_TASKS, 1, 1000, &timed);
+    check(ranInQuanta(&timed, 1), "looper's quantum time not kept to");
+    }
+
+
+// Priorities spread over several words of the priority bitmaps, in no order.
+static const uinta PRIORITIES[] = {64, 3, 200, 0, 127, 65, 1, 255, 63, 128, 191, 192};
+static const uinta PRIORITY_COUNT = sizeof(PRIORITIES)/sizeof(PRIORITIES[0]);
+static const uinta MAX_PRIORITY = 255;
+
+static bool descending(const RunLog *log)
+    {
+    for (uinta i = 1; i < log->count; i++) if (log->ids[i] >= log->ids[i - 1]) return NO;
+    return log->count == PRIORITY_COUNT;
+    }
+
+// Loopers that are ready run highest priority first.
+static void testReadyPriorities(const Options *opts)
+    {
+    Controller *c = singleWorker(opts, MAX_PRIORITY);
+    RunLog log;
+    uinta open = 0;
+    Looper *gate = new Looper();
+    Looper *loopers[PRIORITY_COUNT];
+    c->enqueue(gate, new Gate(&open), MAX_PRIORITY, YES);
+    for (uinta i = 0; i < PRIORITY_COUNT; i++)
+        {
+        loopers[i] = new Looper();
+        c->enqueue(loopers[i], new Logged(&log, PRIORITIES[i], 0), PRIORITIES[i], YES);
+        }
+    __atomic_store_n(&open, 1, __ATOMIC_SEQ_CST);
+    check(waitFor(&log.count, PRIORITY_COUNT), "tasks not all run");
+    check(descending(&log), "ready loopers not run highest priority first");
+    c->safeDelete(gate);
+    for (uinta i = 0; i < PRIORITY_COUNT; i++) c->safeDelete(loopers[i]);
+    }
+
+// Logs its priority, then releases its lock.
+class LoggedLocker : public Task
+    {
+public:
+    LoggedLocker(RunLog *log, Lock *lk) { this->log = log; this->lk = lk; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    RunLog *log;
+    Lock *lk;
+    };
+
+void LoggedLocker::mtllRun(Controller *c, Looper *lpr)
+    {
+    log->add(mtllPriority());
+    c->unlock(lpr, lk);
+    }
+
+// Loopers waiting for a lock are granted it highest priority first.
+static void testWaitingPriorities(const Options *opts, uinta threadCount)
+    {
+    Controller *c = new Controller(threadCount, MAX_PRIORITY, opts);
+    RunLog log;
+    Lock *lk = new Lock(c);
+    Looper *holder = new Looper();
+    Looper *loopers[PRIORITY_COUNT];
+    check(c->attemptLock(holder, lk, YES), "free lock refused");
+    for (uinta i = 0; i < PRIORITY_COUNT; i++)
+        {
+        loopers[i] = new Looper();
+        c->enqueue(loopers[i], new LoggedLocker(&log, lk), PRIORITIES[i], YES, lk, YES);
+        }
+    c->unlock(holder, lk);
+    check(waitFor(&log.count, PRIORITY_COUNT), "waiters not all granted the lock");
+    check(descending(&log), "lock not granted highest priority first");
+    c->safeDelete(holder);
+    for (uinta i = 0; i < PRIORITY_COUNT; i++) c->safeDelete(loopers[i]);
+    c->safeDelete(lk);
+    }
+
+
+// Waits for as many tasks as there are workers to be running at once.
+class Rendezvous : public Task
+    {
+public:
+    Rendezvous(Concurrency *concurrency, uinta count) { this->concurrency = concurrency; this->count = count; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    Concurrency *concurrency;
+    uinta count;
+    };
+
+void Rendezvous::mtllRun(Controller *c, Looper *lpr)
+    {
+    concurrency->enter();
+    waitFor(&concurrency->most, count);
+    concurrency->leave();
+    }
+
+// Making as many loopers ready as there are workers, all parked, wakes them all.
+static void testWakeAll(Controller *c, uinta threadCount)
+    {
+    Concurrency concurrency;
+    Looper **loopers = new Looper*[threadCount];
+    settle();
+    for (uinta i = 0; i < threadCount; i++)
+        {
+        loopers[i] = new Looper();
+        c->enqueue(loopers[i], new Rendezvous(&concurrency, threadCount), 1, YES);
+        }
+    check(waitFor(&concurrency.finished, threadCount), "tasks not all run");
+    check(concurrency.most == threadCount, "parked workers not all woken for as many ready loopers");
+    for (uinta i = 0; i < threadCount; i++) c->safeDelete(loopers[i]);
+    delete[] loopers;
+    }
+
+// Passes itself back and forth between 2 loopers, each hop waking a worker to
+// run it while the worker that enqueued it goes back to park.
+class Relay : public Task
+    {
+public:
+    Relay(Looper **loopers, uinta hops, uinta *done) { this->loopers = loopers; this->hops = hops; this->done = done; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    Looper **loopers;
+    uinta hops;
+    uinta *done;
+    };
+
+void Relay::mtllRun(Controller *c, Looper *lpr)
+    {
+    if (!hops--)
+        {
+        __atomic_store_n(done, 1, __ATOMIC_SEQ_CST);
+        return;
+        }
+    c->enqueue(loopers[lpr == loopers[0]], this, 1, NO);
+    }
+
+// No wakeup's lost while workers are parking and being woken, whether the
+// tasks are enqueued by workers or by another thread.
+static void testNoLostWakeups(Controller *c)
+    {
+    Looper *loopers[2] = {new Looper(), new Looper()};
+    uinta relayed = 0;
+    Relay relay(loopers, 2000, &relayed);
+    c->enqueue(loopers[0], &relay, 1, NO);
+    check(waitFor(&relayed, 1), "relay between loopers stalled");
+    Concurrency concurrency;
+    for (uinta i = 0; i < 200; i++)
+        {
+        c->enqueue(loopers[i & 1], new Sleeper(&concurrency, 0), 1, YES);
+        usleep(i%50);
+        }
+    check(waitFor(&concurrency.finished, 200), "tasks enqueued as workers park not all run");
+    c->safeDelete(loopers[0]);
+    c->safeDelete(loopers[1]);
+    }
+
+// Reads the CPUs of a NUMA node, as listed by the kernel. Returns NO if there's
+// no such node.
+static bool nodeCpus(uinta node, cpu_set_t *cpus)
+    {
+    CPU_ZERO(cpus);
+    char path[64];
+    sprintf(path, "/sys/devices/system/node/node%u/cpulist", (unsigned int)node);
+    FILE *f = fopen(path, "r");
+    if (!f) return NO;
+    char buf[4096];
+    const bool ok = fgets(buf, sizeof(buf), f) != 0;
+    fclose(f);
+    char *p = buf;
+    while (ok && *p >= '0' && *p <= '9')
+        {
+        const uinta first = strtoul(p, &p, 10);
+        const uinta last = *p == '-' ? strtoul(p + 1, &p, 10) : first;
+        for (uinta i = first; i <= last && i < CPU_SETSIZE; i++) CPU_SET(i, cpus);
+        if (*p == ',') p++;
+        }
+    return ok;
+    }
+
+// Records whether its worker's pinned to the given CPUs, or to those of a
+// single NUMA node if none are given, and which CPU it ran on.
+class Placement : public Task
+    {
+public:
+    Placement(const cpu_set_t *cpus, uinta *misplaced, uinta *done) { this->cpus = cpus; this->misplaced = misplaced; this->done = done; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    const cpu_set_t *cpus;
+    uinta *misplaced;
+    uinta *done;
+    };
+
+void Placement::mtllRun(Controller *c, Looper *lpr)
+    {
+    cpu_set_t pinned, common;
+    sched_getaffinity(0, sizeof(pinned), &pinned);
+    bool placed = NO;
+    if (cpus)
+        placed = CPU_EQUAL(&pinned, cpus) && CPU_ISSET(sched_getcpu(), cpus);
+    else
+        for (uinta node = 0; !placed && node < c->nodeCount(); node++)
+            {
+            cpu_set_t nodeSet;
+            if (!nodeCpus(node, &nodeSet)) continue;
+            CPU_AND(&common, &pinned, &nodeSet);
+            placed = CPU_EQUAL(&common, &pinned);
+            }
+    if (!placed) __atomic_add_fetch(misplaced, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(done, 1, __ATOMIC_SEQ_CST);
+    }
+
+static void runPlacements(Controller *c, const cpu_set_t *cpus, uinta count, uinta *misplaced)
+    {
+    uinta done = 0;
+    Looper **loopers = new Looper*[c->nodeCount()];
+    for (uinta i = 0; i < c->nodeCount(); i++)
+        {
+        loopers[i] = new Looper();
+        c->setHomeNode(loopers[i], i);
+        }
+    for (uinta i = 0; i < count; i++) c->enqueue(loopers[i%c->nodeCount()], new Placement(cpus, misplaced, &done), 1, YES);
+    check(waitFor(&done, count), "tasks of loopers with home nodes not all run");
+    for (uinta i = 0; i < c->nodeCount(); i++) c->safeDelete(loopers[i]);
+    delete[] loopers;
+    }
+
+// Workers given CPU sets stay on them. In NUMA aware mode workers are pinned to
+// the CPUs of their node, and every node the kernel lists has loopers' tasks
+// run for it.
+static void testPlacement(const Options *opts, uinta threadCount)
+    {
+    cpu_set_t allowed, first;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    CPU_ZERO(&first);
+    for (uinta cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            {
+            CPU_SET(cpu, &first);
+            break;
+            }
+    Options pinned = *opts;
+    pinned.cpuSets = &first;
+    pinned.cpuSetCount = 1;
+    uinta misplaced = 0;
+    runPlacements(new Controller(threadCount, 2, &pinned), &first, 100, &misplaced);
+    check(!misplaced, "tasks run off the CPUs their workers were given");
+    if (!opts->numaAware) return;
+    Controller *c = new Controller(threadCount, 2, opts);
+    uinta nodes = 0;
+    cpu_set_t cpus;
+    while (nodeCpus(nodes, &cpus)) nodes++;
+    check(c->nodeCount() >= (nodes ? nodes : 1), "NUMA nodes missing");
+    runPlacements(c, 0, 100, &misplaced);
+    check(!misplaced, "NUMA aware workers not pinned to a node's CPUs");
+    }
+
+
+// Reenqueues itself on its looper, counting how often it's run by the same
+// worker thread as last time.
+class Resumer : public Task
+    {
+public:
+    Resumer(uinta runs, uinta *sameThread, uinta *done) { this->runs = runs; this->sameThread = sameThread; this->done = done; last = 0; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta runs;
+    uinta *sameThread;
+    uinta *done;
+    pthread_t last;
+    };
+
+void Resumer::mtllRun(Controller *c, Looper *lpr)
+    {
+    const pthread_t self = pthread_self();
+    if (last && pthread_equal(self, last)) (*sameThread)++;
+    last = self;
+    if (--runs) c->enqueue(lpr, this, 1, NO);
+    else __atomic_store_n(done, 1, __ATOMIC_SEQ_CST);
+    }
+
+// A looper made ready by its own task's resumed by the worker that last ran
+// it, from the worker's runnext slot. Fair share mode gives that up for
+// ordering by virtual runtime.
+static void testRunnextAffinity(Controller *c, const Options *opts)
+    {
+    if (opts->fairShare) return;
+    uinta resumedBefore, hitsBefore, resumed, hits;
+    c->affinityCounts(&resumedBefore, &hitsBefore);
+    Looper *lpr = new Looper();
+    uinta sameThread = 0, done = 0;
+    Resumer resumer(200, &sameThread, &done);
+    c->enqueue(lpr, &resumer, 1, NO);
+    check(waitFor(&done, 1), "self reenqueuing looper stalled");
+    c->affinityCounts(&resumed, &hits);
+    // It's popped once a quantum.
+    const uinta pops = 200/opts->quantumTasks;
+    check(resumed - resumedBefore >= pops - 1, "resumed loopers not counted");
+    check(hits - hitsBefore >= pops/2, "loopers not mostly resumed by their last worker");
+    check(sameThread >= 100, "self reenqueuing looper not mostly run on the same thread");
+    c->safeDelete(lpr);
+    }
+
+
+// Blocks until all of its kind are blocking at once, or a second's passed.
+class Blocker : public Task
+    {
+public:
+    Blocker(uinta *inside, uinta count, uinta *allInside, uinta *done) { this->inside = inside; this->count = count; this->allInside = allInside; this->done = done; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *inside;
+    uinta count;
+    uinta *allInside;
+    uinta *done;
+    };
+
+void Blocker::mtllRun(Controller *c, Looper *lpr)
+    {
+    c->beginBlocking();
+    __atomic_add_fetch(inside, 1, __ATOMIC_SEQ_CST);
+    for (uinta i = 0; i < 1000 && __atomic_load_n(inside, __ATOMIC_SEQ_CST) < count; i++) usleep(1000);
+    if (__atomic_load_n(inside, __ATOMIC_SEQ_CST) >= count) __atomic_add_fetch(allInside, 1, __ATOMIC_SEQ_CST);
+    c->endBlocking();
+    __atomic_add_fetch(done, 1, __ATOMIC_SEQ_CST);
+    }
+
+class Tick : public Task
+    {
+public:
+    Tick(uinta *ticks) { this->ticks = ticks; }
+    void mtllRun(Controller *c, Looper *lpr) { __atomic_add_fetch(ticks, 1, __ATOMIC_SEQ_CST); }
+
+private:
+    uinta *ticks;
+    };
+
+// Workers blocking in tasks are made up for with extra workers, so more tasks
+// than there are threads can all block at once. And when the extra workers
+// retire as they idle, timers still fire.
+static void testBlocking(Controller *c, const Options *opts, uinta threadCount)
+    {
+    uinta ticks = 0;
+    Looper *timed = opts->autoScale ? new Looper() : 0;
+    Tick tick(&ticks);
+    if (timed) c->enqueueEvery(timed, &tick, 1, NO, 2000);
+    const uinta count = threadCount + 1;
+    for (uinta round = 0; round < (timed ? 5 : 1); round++)
+        {
+        uinta inside = 0, allInside = 0, done = 0;
+        Looper **loopers = new Looper*[count];
+        for (uinta i = 0; i < count; i++)
+            {
+            loopers[i] = new Looper();
+            c->enqueue(loopers[i], new Blocker(&inside, count, &allInside, &done), 0, YES);
+            }
+        check(waitFor(&done, count), "blocking tasks not all run");
+        check(allInside == count, "no extra workers started for workers blocking");
+        for (uinta i = 0; i < count; i++) c->safeDelete(loopers[i]);
+        delete[] loopers;
+        if (!timed) continue;
+        // Long enough for the extra workers to retire.
+        usleep(20000);
+        const uinta before = __atomic_load_n(&ticks, __ATOMIC_SEQ_CST);
+        check(waitFor(&ticks, before + 5), "timer stalled as extra workers retired");
+        }
+    if (!timed) return;
+    c->cancel(&tick);
+    c->safeDelete(timed);
+    settle();
+    }
+
+
+// Records when it's run.
+class Stamp : public Task
+    {
+public:
+    Stamp(uint64 *when, uinta *done) { this->when = when; this->done = done; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uint64 *when;
+    uinta *done;
+    };
+
+void Stamp::mtllRun(Controller *c, Looper *lpr)
+    {
+    *when = c->now();
+    __atomic_store_n(done, 1, __ATOMIC_SEQ_CST);
+    }
+
+// Timers never fire early, periodic ones keep firing until they're cancelled,
+// and a Task whose timer's been cancelled can be enqueued again like any other.
+static void testTimers(Controller *c)
+    {
+    Looper *lpr = new Looper();
+    uint64 when = 0;
+    uinta done = 0;
+    Stamp stamp(&when, &done);
+    uint64 start = c->now();
+    c->enqueueAfter(lpr, &stamp, 1, NO, 20000);
+    check(waitFor(&done, 1), "delayed task not run");
+    check(when >= start + 20000, "delayed task run early");
+    done = 0;
+    start = c->now();
+    c->enqueueAt(lpr, &stamp, 1, NO, start + 20000);
+    check(waitFor(&done, 1), "task enqueued for a time not run");
+    check(when >= start + 20000, "task enqueued for a time run early");
+
+    uinta ticks = 0;
+    Tick tick(&ticks);
+    c->enqueueEvery(lpr, &tick, 1, NO, 2000);
+    check(waitFor(&ticks, 5), "periodic task not rerun");
+    c->cancel(&tick);
+    settle();
+    uinta before = __atomic_load_n(&ticks, __ATOMIC_SEQ_CST);
+    settle();
+    check(__atomic_load_n(&ticks, __ATOMIC_SEQ_CST) == before, "cancelled periodic task still run");
+    c->enqueue(lpr, &tick, 1, NO);
+    check(waitFor(&ticks, before + 1), "reused task not run");
+    settle();
+    check(__atomic_load_n(&ticks, __ATOMIC_SEQ_CST) == before + 1, "reused task run again by its cancelled timer");
+
+    Tick never(&ticks);
+    c->enqueueAfter(lpr, &never, 1, NO, 10000000);
+    check(c->cancel(&never), "waiting timer not cancelled");
+    check(!c->cancel(&never), "timer cancelled twice");
+    before = __atomic_load_n(&ticks, __ATOMIC_SEQ_CST);
+    c->enqueue(lpr, &never, 1, NO);
+    check(waitFor(&ticks, before + 1), "task reused after its timer was cancelled not run");
+    settle();
+    check(__atomic_load_n(&ticks, __ATOMIC_SEQ_CST) == before + 1, "task reused after its timer was cancelled run again");
+    c->safeDelete(lpr);
+    }
+
+
+// Drains the pipe it's watching, recording the events it was run for.
+class PipeReader : public Task
+    {
+public:
+    PipeReader(int fd, uinta *runs, uinta *readable, uinta *deleted) { this->fd = fd; this->runs = runs; this->readable = readable; this->deleted = deleted; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+protected:
+    ~PipeReader() { __atomic_add_fetch(deleted, 1, __ATOMIC_SEQ_CST); }
+
+private:
+    int fd;
+    uinta *runs;
+    uinta *readable;
+    uinta *deleted;
+    };
+
+void PipeReader::mtllRun(Controller *c, Looper *lpr)
+    {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0);
+    if (mtllEvents() & EPOLLIN) __atomic_add_fetch(readable, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(runs, 1, __ATOMIC_SEQ_CST);
+    }
+
+// A watched file descriptor's task is run each time it becomes readable, and
+// once it's unwatched it isn't any more, and is deleted if required.
+static void testWatch(Controller *c)
+    {
+    int fds[2];
+    check(!pipe(fds), "pipe not created");
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    Looper *lpr = new Looper();
+    uinta runs = 0, readable = 0, deleted = 0;
+    PipeReader *reader = new PipeReader(fds[0], &runs, &readable, &deleted);
+    check(c->watch(fds[0], EPOLLIN, lpr, reader, 1, YES), "pipe not watched");
+    for (uinta i = 1; i <= 3; i++)
+        {
+        check(write(fds[1], "x", 1) == 1, "pipe not written");
+        check(waitFor(&runs, i), "watching task not run for readable pipe");
+        settle();
+        }
+    check(runs == 3, "watching task run too often");
+    check(readable == 3, "watching task not given EPOLLIN");
+    c->unwatch(reader);
+    check(waitFor(&deleted, 1), "unwatched task not deleted");
+    check(write(fds[1], "x", 1) == 1, "pipe not written");
+    settle();
+    check(runs == 3, "unwatched task run");
+    close(fds[0]);
+    close(fds[1]);
+    c->safeDelete(lpr);
+    }
+
+
+// Records the result of the I/O operation it was enqueued on completion of.
+class IoDone : public Task
+    {
+public:
+    IoDone(inta *result, uinta *done) { this->result = result; this->done = done; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    inta *result;
+    uinta *done;
+    };
+
+void IoDone::mtllRun(Controller *c, Looper *lpr)
+    {
+    *result = mtllResult();
+    __atomic_add_fetch(done, 1, __ATOMIC_SEQ_CST);
+    }
+
+static const uinta IO_BLOCKS = 8;
+static const uinta IO_BLOCK_SIZE = 256;
+
+// Submits the reads of each block of the file, and 1 past its end, from a
+// worker.
+class ReadSubmitter : public Task
+    {
+public:
+    ReadSubmitter(int fd, char *bufs, inta *results, uinta *done) { this->fd = fd; this->bufs = bufs; this->results = results; this->done = done; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    int fd;
+    char *bufs;
+    inta *results;
+    uinta *done;
+    };
+
+void ReadSubmitter::mtllRun(Controller *c, Looper *lpr)
+    {
+    for (uinta i = 0; i <= IO_BLOCKS; i++)
+        {
+        BatchEntry e(lpr, new IoDone(results + i, done), 1, YES);
+        c->submitRead(fd, bufs + i*IO_BLOCK_SIZE, IO_BLOCK_SIZE, i*IO_BLOCK_SIZE, &e);
+        }
+    }
+
+// Writes submitted by another thread and reads submitted by a worker complete
+// with their results, both with io_uring and with the offload threads.
+static void testIo(const Options *opts, uinta threadCount)
+    {
+    static char written[IO_BLOCKS*IO_BLOCK_SIZE];
+    static char bufs[(IO_BLOCKS + 1)*IO_BLOCK_SIZE];
+    for (uinta i = 0; i < sizeof(written); i++) written[i] = (char)(i*7 + i/IO_BLOCK_SIZE);
+    for (uinta uring = 0; uring < 2; uring++)
+        {
+        Options o = *opts;
+        o.ioUring = uring;
+        Controller *c = new Controller(threadCount, 2, &o);
+        char path[] = "/tmp/MTLL_testXXXXXX";
+        const int fd = mkstemp(path);
+        check(fd >= 0, "temporary file not created");
+        unlink(path);
+        Looper *lpr = new Looper();
+        inta results[IO_BLOCKS + 1];
+        uinta done = 0;
+        for (uinta i = 0; i < IO_BLOCKS; i++)
+            {
+            BatchEntry e(lpr, new IoDone(results + i, &done), 1, YES);
+            c->submitWrite(fd, written + i*IO_BLOCK_SIZE, IO_BLOCK_SIZE, i*IO_BLOCK_SIZE, &e);
+            }
+        check(waitFor(&done, IO_BLOCKS), "write completions not all run");
+        for (uinta i = 0; i < IO_BLOCKS; i++) check(results[i] == (inta)IO_BLOCK_SIZE, "write result wrong");
+        done = 0;
+        memset(bufs, 0, sizeof(bufs));
+        c->enqueue(lpr, new ReadSubmitter(fd, bufs, results, &done), 1, YES);
+        check(waitFor(&done, IO_BLOCKS + 1), "read completions not all run");
+        for (uinta i = 0; i < IO_BLOCKS; i++) check(results[i] == (inta)IO_BLOCK_SIZE, "read result wrong");
+        check(!results[IO_BLOCKS], "read past the end of the file not 0");
+        check(!memcmp(bufs, written, sizeof(written)), "read data wrong");
+        done = 0;
+        BatchEntry e(lpr, new IoDone(results, &done), 1, YES);
+        c->submitRead(-1, bufs, IO_BLOCK_SIZE, 0, &e);
+        check(waitFor(&done, 1), "failed read's completion not run");
+        check(results[0] == -EBADF, "failed read's result not the error");
+        close(fd);
+        c->safeDelete(lpr);
+        }
+    }
+
+
+#ifdef MTLL_COROUTINES
+static const uinta COROUTINES = 32;
+static const uinta COROUTINE_ROUNDS = 20;
+
+static Coroutine<uinta> square(Controller *c, uinta x)
+    {
+    co_await c->sleepFor(x%3*100);
+    co_return x*x;
+    }
+
+// Each round it takes the lock, sometimes sleeping while it holds it, then
+// calls a coroutine on another looper.
+static Coroutine<> lockSleepCall(Controller *c, Looper *lpr, Lock *lk, Looper **callees, uinta id, uinta *holders, uinta *wrong, uinta *finished)
+    {
+    for (uinta i = 0; i < COROUTINE_ROUNDS; i++)
+        {
+        co_await c->lock(lk, YES);
+        if (__atomic_add_fetch(holders, 1, __ATOMIC_SEQ_CST) != 1) __atomic_add_fetch(wrong, 1, __ATOMIC_SEQ_CST);
+        if (!(i%5))
+            {
+            const uint64 start = c->now();
+            co_await c->sleepFor(200);
+            if (c->now() - start < 200) __atomic_add_fetch(wrong, 1, __ATOMIC_SEQ_CST);
+            }
+        __atomic_sub_fetch(holders, 1, __ATOMIC_SEQ_CST);
+        c->unlock(lpr, lk);
+        const uinta x = id + i;
+        if (co_await c->call(callees[x%4], square(c, x)) != x*x) __atomic_add_fetch(wrong, 1, __ATOMIC_SEQ_CST);
+        }
+    __atomic_add_fetch(finished, 1, __ATOMIC_SEQ_CST);
+    }
+
+// Coroutines awaiting a lock hold it exclusively once they're resumed, sleeping
+// ones aren't resumed early, and called ones return their values.
+static void testCoroutines(Controller *c)
+    {
+    Lock *lk = new Lock(c);
+    Looper *callees[4];
+    for (uinta i = 0; i < 4; i++) callees[i] = new Looper();
+    Looper *loopers[COROUTINES];
+    uinta holders = 0, wrong = 0, finished = 0;
+    for (uinta i = 0; i < COROUTINES; i++)
+        {
+        loopers[i] = new Looper();
+        c->enqueue(loopers[i], lockSleepCall(c, loopers[i], lk, callees, i, &holders, &wrong, &finished).task(), i%2, NO);
+        }
+    check(waitFor(&finished, COROUTINES), "coroutines not all finished");
+    check(!wrong, "coroutines' locking, sleeping or calls wrong");
+    for (uinta i = 0; i < COROUTINES; i++) c->safeDelete(loopers[i]);
+    for (uinta i = 0; i < 4; i++) c->safeDelete(callees[i]);
+    c->safeDelete(lk);
+    }
+#endif // #ifdef MTLL_COROUTINES
+
+
+// Adds to the value of the future it's given, if any.
+class Add : public FutureTask<uinta>
+    {
+public:
+    Add(uinta add) { this->add = add; }
+    Add(const Future<uinta> &in, uinta add) : in(in) { this->add = add; }
+    uinta mtllCompute(Controller *c, Looper *lpr) { return (in.ready() ? in.value() : 0) + add; }
+
+private:
+    Future<uinta> in;
+    uinta add;
+    };
+
+#ifdef MTLL_COROUTINES
+static Coroutine<> awaitDone(Future<void> f, uinta *done)
+    {
+    co_await f;
+    __atomic_add_fetch(done, 1, __ATOMIC_SEQ_CST);
+    }
+#endif // #ifdef MTLL_COROUTINES
+
+// Continuations run once the futures they're attached to are ready, whether
+// they're tasks or closures returning a value or nothing, and whenAll() and
+// whenAny() are ready once all or the first of their futures are.
+static void testFutures(Controller *c)
+    {
+    Looper *a = new Looper(), *b = new Looper();
+    uinta seen = 0, done = 0;
+    Future<uinta> f = c->enqueueFuture(a, new Add(1), 1);
+    Future<uinta> g = f.then(b, 1, new Add(f, 2));
+    Future<uinta> h = g.then(a, 1, [g] { return g.value()*10; });
+    Future<void> v = h.then(b, 1, [h, &seen] { __atomic_store_n(&seen, h.value(), __ATOMIC_SEQ_CST); });
+    v.then(a, 1, new Tick(&done), YES);
+    check(waitFor(&done, 1), "continuations not all run");
+    check(h.ready() && h.value() == 30, "continuations' values wrong");
+    check(v.ready() && seen == 30, "closure returning nothing not run");
+#ifdef MTLL_COROUTINES
+    c->enqueue(a, awaitDone(v, &done).task(), 1, NO);
+    check(waitFor(&done, 2), "coroutine awaiting future with no value not resumed");
+#endif
+
+    AnyFuture all[4];
+    for (uinta i = 0; i < 4; i++) all[i] = c->enqueueFuture(i%2 ? a : b, new Add(i), 1);
+    Future<uinta> joined = c->whenAll(all, 4);
+    done = 0;
+    joined.then(a, 1, new Tick(&done), YES);
+    check(waitFor(&done, 1), "whenAll() never ready");
+    check(joined.value() == 4, "whenAll() value not the number of futures");
+    for (uinta i = 0; i < 4; i++) check(all[i].ready(), "whenAll() ready before all its futures");
+
+    Lock *lk = new Lock(c);
+    Looper *holder = new Looper();
+    check(c->attemptLock(holder, lk, YES), "free lock not got");
+    AnyFuture any[2];
+    any[0] = c->enqueueFuture(a, new Add(1), 1, lk, YES);
+    any[1] = c->enqueueFuture(b, new Add(2), 1);
+    Future<uinta> first = c->whenAny(any, 2);
+    done = 0;
+    first.then(b, 1, new Tick(&done), YES);
+    check(waitFor(&done, 1), "whenAny() never ready");
+    check(first.value() == 1 && !any[0].ready(), "whenAny() value not the index of the first ready future");
+    c->unlock(holder, lk);
+    any[0].then(b, 1, new Tick(&done), YES);
+    check(waitFor(&done, 2), "future waiting for lock never ready");
+    c->safeDelete(a);
+    c->safeDelete(b);
+    c->safeDelete(holder);
+    c->safeDelete(lk);
+    }
+
+
+// Runs until it's let go, optionally enqueueing a task after quiescence first.
+class Holder : public Task
+    {
+public:
+    Holder(uinta *running, uinta *open, Looper *after, Task *t) { this->running = running; this->open = open; this->after = after; this->t = t; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *running;
+    uinta *open;
+    Looper *after;
+    Task *t;
+    };
+
+void Holder::mtllRun(Controller *c, Looper *lpr)
+    {
+    __atomic_store_n(running, 1, __ATOMIC_SEQ_CST);
+    if (after) c->enqueueAfterQuiescence(after, t, 1, YES);
+    while (!__atomic_load_n(open, __ATOMIC_SEQ_CST)) usleep(100);
+    __atomic_store_n(running, 0, __ATOMIC_SEQ_CST);
+    }
+
+// Counts the times it's run while a Holder's still running.
+class Witness : public Task
+    {
+public:
+    Witness(uinta *running, uinta *wrong, uinta *done) { this->running = running; this->wrong = wrong; this->done = done; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *running;
+    uinta *wrong;
+    uinta *done;
+    };
+
+void Witness::mtllRun(Controller *c, Looper *lpr)
+    {
+    if (__atomic_load_n(running, __ATOMIC_SEQ_CST)) __atomic_add_fetch(wrong, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(done, 1, __ATOMIC_SEQ_CST);
+    }
+
+// A task enqueued after quiescence doesn't run until the tasks running when it
+// was enqueued, including the one enqueueing it, have finished. Other loopers
+// carry on meanwhile.
+static void testQuiescence(Controller *c, uinta threadCount)
+    {
+    Looper *held = new Looper(), *later = new Looper(), *other = new Looper();
+    uinta wrong = 0, done = 0;
+    for (uinta fromTask = 0; fromTask < 2; fromTask++)
+        {
+        uinta running = 0, open = 0, ticks = 0;
+        Witness *witness = new Witness(&running, &wrong, &done);
+        c->enqueue(held, new Holder(&running, &open, fromTask ? later : 0, witness), 1, YES);
+        check(waitFor(&running, 1), "holding task not run");
+        if (!fromTask) c->enqueueAfterQuiescence(later, witness, 1, YES);
+        if (threadCount > 1)
+            {
+            c->enqueue(other, new Tick(&ticks), 1, YES);
+            check(waitFor(&ticks, 1), "other looper halted waiting for quiescence");
+            }
+        settle();
+        check(done == fromTask, "task run before quiescence");
+        __atomic_store_n(&open, 1, __ATOMIC_SEQ_CST);
+        check(waitFor(&done, fromTask + 1), "task enqueued after quiescence not run");
+        }
+    check(!wrong, "task enqueued after quiescence run while a task running before it was");
+    c->safeDelete(held);
+    c->safeDelete(later);
+    c->safeDelete(other);
+    }
+
+
+// Keeps reenqueueing itself until it's told to finish, counting its runs and
+// how many of its kind are running.
+class Spinner : public Task
+    {
+public:
+    Spinner(uinta *inside, uinta *runs, uinta *finish) { this->inside = inside; this->runs = runs; this->finish = finish; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *inside;
+    uinta *runs;
+    uinta *finish;
+    };
+
+void Spinner::mtllRun(Controller *c, Looper *lpr)
+    {
+    __atomic_add_fetch(inside, 1, __ATOMIC_SEQ_CST);
+    usleep(100);
+    __atomic_sub_fetch(inside, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(runs, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(finish, __ATOMIC_SEQ_CST)) c->enqueue(lpr, this, 1, NO);
+    }
+
+// Checks that none of the group's loopers run while it does, and whether other
+// loopers do.
+class GroupStopper : public Task
+    {
+public:
+    GroupStopper(uinta *inside, uinta *runs, uinta *otherRuns, uinta *wrong, uinta *othersRan, uinta *done)
+        { this->inside = inside; this->runs = runs; this->otherRuns = otherRuns; this->wrong = wrong; this->othersRan = othersRan; this->done = done; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *inside;
+    uinta *runs;
+    uinta *otherRuns;
+    uinta *wrong;
+    uinta *othersRan;
+    uinta *done;
+    };
+
+void GroupStopper::mtllRun(Controller *c, Looper *lpr)
+    {
+    const uinta runsBefore = __atomic_load_n(runs, __ATOMIC_SEQ_CST);
+    const uinta otherRunsBefore = __atomic_load_n(otherRuns, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(inside, __ATOMIC_SEQ_CST)) (*wrong)++;
+    usleep(5000);
+    if (__atomic_load_n(inside, __ATOMIC_SEQ_CST) || __atomic_load_n(runs, __ATOMIC_SEQ_CST) != runsBefore) (*wrong)++;
+    if (__atomic_load_n(otherRuns, __ATOMIC_SEQ_CST) != otherRunsBefore) (*othersRan)++;
+    __atomic_add_fetch(done, 1, __ATOMIC_SEQ_CST);
+    }
+
+// A group's loopers are all halted while its "Stop the Group" tasks run, and
+// the loopers outside the group aren't.
+static void testGroupStop(Controller *c, uinta threadCount)
+    {
+    static const uinta MEMBERS = 4;
+    LooperGroup *g = new LooperGroup(c);
+    Looper *members[MEMBERS];
+    Spinner *spinners[MEMBERS];
+    Looper *outsider = new Looper();
+    uinta inside = 0, runs = 0, otherInside = 0, otherRuns = 0, finish = 0;
+    for (uinta i = 0; i < MEMBERS; i++)
+        {
+        members[i] = new Looper(g);
+        spinners[i] = new Spinner(&inside, &runs, &finish);
+        c->enqueue(members[i], spinners[i], 1, NO);
+        }
+    Spinner otherSpinner(&otherInside, &otherRuns, &finish);
+    c->enqueue(outsider, &otherSpinner, 1, NO);
+    uinta wrong = 0, othersRan = 0, done = 0;
+    for (uinta i = 1; i <= 5; i++)
+        {
+        check(waitFor(&runs, __atomic_load_n(&runs, __ATOMIC_SEQ_CST) + MEMBERS), "group's loopers not run");
+        c->enqueueAndStopTheGroup(g, new GroupStopper(&inside, &runs, &otherRuns, &wrong, &othersRan, &done), YES);
+        check(waitFor(&done, i), "Stop the Group task not run");
+        }
+    check(!wrong, "group's loopers run while it was stopped");
+    if (threadCount > 1) check(othersRan == 5, "loopers outside the group halted while it was stopped");
+    __atomic_store_n(&finish, 1, __ATOMIC_SEQ_CST);
+    settle();
+    c->safeDelete(g);
+    c->safeDelete(outsider);
+    for (uinta i = 0; i < MEMBERS; i++) delete spinners[i];
+    }
+
+
+// Keeps its worker busy for a while, and reenqueues itself until it's told to
+// finish.
+class Busy : public Task
+    {
+public:
+    Busy(uinta *finish) { this->finish = finish; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *finish;
+    };
+
+void Busy::mtllRun(Controller *c, Looper *lpr)
+    {
+    const uint64 start = c->now();
+    while (c->now() - start < 200);
+    if (!__atomic_load_n(finish, __ATOMIC_SEQ_CST)) c->enqueue(lpr, this, 1, NO);
+    }
+
+// In fair share mode loopers that are always ready share a worker's time in
+// proportion to their weights.
+static void testFairShare(const Options *opts)
+    {
+    Options fair = *opts;
+    fair.fairShare = YES;
+    Controller *c = singleWorker(&fair, 2);
+    Looper *light = new Looper(), *heavy = new Looper();
+    c->setWeight(heavy, 3);
+    uinta finish = 0;
+    Busy lightBusy(&finish), heavyBusy(&finish);
+    c->enqueue(light, &lightBusy, 1, NO);
+    c->enqueue(heavy, &heavyBusy, 1, NO);
+    usleep(300000);
+    __atomic_store_n(&finish, 1, __ATOMIC_SEQ_CST);
+    settle();
+    const uint64 lightNanos = c->runNanos(light), heavyNanos = c->runNanos(heavy);
+    check(lightNanos && heavyNanos > 2*lightNanos && heavyNanos < 4*lightNanos, "loopers' run times not in proportion to their weights");
+    c->safeDelete(light);
+    c->safeDelete(heavy);
+    }
+
+
+class Tagged
+    {
+public:
+    Tagged() { tag = TAG; }
+    virtual ~Tagged() { tag = 0; }
+
+    static const uint64 TAG = 0x5441474745440000ull;
+    uint64 tag;
+    };
+
+// A Task that isn't its class's first base, so it's not at the start of its
+// block.
+class SecondBase : public Tagged, public Task
+    {
+public:
+    SecondBase(uinta *runs, uinta *deleted) { this->runs = runs; this->deleted = deleted; }
+    ~SecondBase() { __atomic_add_fetch(deleted, 1, __ATOMIC_SEQ_CST); }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *runs;
+    uinta *deleted;
+    };
+
+void SecondBase::mtllRun(Controller *c, Looper *lpr)
+    {
+    check(tag == TAG, "pooled task overwritten");
+    __atomic_add_fetch(runs, 1, __ATOMIC_SEQ_CST);
+    }
+
+// On a worker a deleted task's block is the next one handed out, as it's on
+// top of the worker's cache.
+class Recycler : public Task
+    {
+public:
+    Recycler(uinta *done) { this->done = done; }
+    void mtllRun(Controller *c, Looper *lpr);
+
+private:
+    uinta *done;
+    };
+
+void Recycler::mtllRun(Controller *c, Looper *lpr)
+    {
+    uinta runs = 0, deleted = 0;
+    for (uinta i = 0; i < 100; i++)
+        {
+        SecondBase *t = c->newTask<SecondBase>(&runs, &deleted);
+        void *block = dynamic_cast<void*>(t);
+        c->deleteTask(t);
+        t = c->newTask<SecondBase>(&runs, &deleted);
+        check(dynamic_cast<void*>(t) == block, "pooled task's block not recycled");
+        c->deleteTask(t);
+        }
+    check(deleted == 200, "pooled tasks not destroyed");
+    __atomic_store_n(done, 1, __ATOMIC_SEQ_CST);
+    }
+
+// Tasks made by newTask(), including closures' and those of classes where Task
+// isn't the first base, are run and deleted, and their blocks reused, whether or
+// not they've needed side state for a timer.
+static void testPooledTasks(Controller *c)
+    {
+    Looper *lpr = new Looper();
+    uinta ran = 0;
+    for (uinta i = 0; i < 100; i++) c->enqueue(lpr, [&ran] { __atomic_add_fetch(&ran, 1, __ATOMIC_SEQ_CST); }, 1);
+    char big[TASK_BLOCK_SIZE];
+    memset(big, 1, sizeof(big));
+    c->enqueue(lpr, [&ran, big] { if (big[TASK_BLOCK_SIZE - 1] == 1) __atomic_add_fetch(&ran, 1, __ATOMIC_SEQ_CST); }, 1);
+    check(waitFor(&ran, 101), "closures not all run");
+    uinta runs = 0, deleted = 0;
+    for (uinta round = 0; round < 3; round++)
+        {
+        for (uinta i = 0; i < 100; i++)
+            {
+            SecondBase *t = c->newTask<SecondBase>(&runs, &deleted);
+            if (i%2)
+                c->enqueue(lpr, t, 1, YES);
+            else
+                c->enqueueAfter(lpr, t, 1, YES, 1000);
+            }
+        check(waitFor(&deleted, 100*(round + 1)), "pooled tasks not all deleted");
+        }
+    check(runs == 300, "pooled tasks not all run");
+    uinta done = 0;
+    c->enqueue(lpr, new Recycler(&done), 1, YES);
+    check(waitFor(&done, 1), "recycling task not run");
+    c->safeDelete(lpr);
+    }
+
+
+
+int main(int argc, char **argv)
+    {
+    const uinta threadCount = argc > 1 ? strtoul(argv[1], 0, 0) : 4;
+    for (uinta mode = 0; mode < SCHEDULER_MODE_COUNT; mode++)
+        {
+        Options opts;
+        currentMode = schedulerMode(mode, &opts, threadCount);
+        Controller *c = new Controller(threadCount, 2, &opts);
+        testSpread(c, threadCount);
+        testProducers(c);
+        testDeleteBusyLooper(c);
+        testBatch(c);
+        testQuantum(&opts);
+        testReadyPriorities(&opts);
+        testWaitingPriorities(&opts, threadCount);
+        testWakeAll(c, threadCount);
+        testNoLostWakeups(c);
+        testPlacement(&opts, threadCount);
+        testRunnextAffinity(c, &opts);
+        testBlocking(c, &opts, threadCount);
+        testTimers(c);
+        testWatch(c);
+        testIo(&opts, threadCount);
+#ifdef MTLL_COROUTINES
+        testCoroutines(c);
+#endif
+        testFutures(c);
+        testQuiescence(c, threadCount);
+        testGroupStop(c, threadCount);
+        testFairShare(&opts);
+        testPooledTasks(c);
+        }
+    return report("scheduling");
+    }
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2020 transmission.aquitaine@yahoo.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef MTLL_TEST_HPP_
+#define MTLL_TEST_HPP_
+
+
+
+#include <unistd.h>
+
+#include <stdio.h>
+
+#include "MTLL.hpp"
+using namespace MTLL;
+
+
+
+// What the test programs share: counting failed checks, waiting for tasks to
+// get somewhere, and the scheduler modes every test's run in.
+
+
+
+static uinta failures;
+static const char *currentMode = "";
+
+static inline void check(bool ok, const char *what)
+    {
+    if (ok) return;
+    printf("FAILED (%s): %s\n", currentMode, what);
+    __atomic_add_fetch(&failures, 1, __ATOMIC_SEQ_CST);
+    }
+
+// Waits up to 10 seconds for the count to reach n.
+static inline bool waitFor(uinta *count, uinta n)
+    {
+    for (uinta i = 0; i < 10000; i++)
+        {
+        if (__atomic_load_n(count, __ATOMIC_SEQ_CST) >= n) return YES;
+        usleep(1000);
+        }
+    return NO;
+    }
+
+// Long enough for a task that's wrongly been let in to have run.
+static inline void settle()
+    {
+    usleep(20000);
+    }
+
+// Sets the options for one of the scheduler modes, and returns its name.
+static const uinta SCHEDULER_MODE_COUNT = 7;
+
+static inline const char *schedulerMode(uinta mode, Options *opts, uinta threadCount)
+    {
+    switch (mode)
+        {
+        case 1:
+            opts->workStealing = YES;
+            return "work stealing";
+        case 2:
+            opts->quantumTasks = 4;
+            return "quantum";
+        case 3:
+            opts->spinMicros = 200;
+            return "spinning";
+        case 4:
+            opts->numaAware = YES;
+            return "NUMA aware";
+        case 5:
+            opts->autoScale = YES;
+            opts->maxThreads = 2*threadCount + 1;
+            opts->idleRetireMicros = 5000;
+            return "elastic";
+        case 6:
+            opts->fairShare = YES;
+            return "fair share";
+        default:
+            return "global queue";
+        }
+    }
+
+// Prints the number of failed checks, and returns the program's exit status.
+static inline int report(const char *program)
+    {
+    if (failures)
+        {
+        printf("%lu checks failed\n", (unsigned long)failures);
+        return 1;
+        }
+    printf("all %s checks passed\n", program);
+    return 0;
+    }
+
+
+
+#endif // #ifndef MTLL_TEST_HPP_